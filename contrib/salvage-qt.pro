@@ -62,6 +62,7 @@ HEADERS += src/activemasternode.h \
            src/allocators.h \
            src/amount.h \
            src/base58.h \
+           src/blockserver.h \
            src/bloom.h \
            src/chain.h \
            src/chainparams.h \
@@ -82,6 +83,7 @@ HEADERS += src/activemasternode.h \
            src/db.h \
            src/eccryptoverify.h \
            src/ecwrapper.h \
+           src/flat-database.h \
            src/hash.h \
            src/init.h \
            src/Instantx.h \
@@ -364,6 +366,7 @@ SOURCES += src/activemasternode.cpp \
            src/allocators.cpp \
            src/amount.cpp \
            src/base58.cpp \
+           src/blockserver.cpp \
            src/bloom.cpp \
            src/chain.cpp \
            src/chainparams.cpp \
@@ -6,9 +6,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 //
 #include "Darksend.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "init.h"
 #include "main.h"
+#include "masternode-budget.h"
 #include "masternodeman.h"
 #include "script/sign.h"
 #include "Instantx.h"
@@ -2163,22 +2165,127 @@ bool CDarKsendSigner::SignMessage(std::string strMessage, std::string& errorMess
     return true;
 }
 
-bool CDarKsendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+static uint256 GetMessageHash(const std::string& strMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    return ss.GetHash();
+}
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
+bool CDarKsendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    uint256 hash = GetMessageHash(strMessage);
+
+    CKeyID keyID;
+    bool fRecovered = false;
+    {
+        LOCK(cs);
+        if (!mapRecovered.empty()) {
+            std::map<uint256, CKeyID>::iterator it = mapRecovered.find(Hash(hash.begin(), hash.end(), vchSig.begin(), vchSig.end()));
+            if (it != mapRecovered.end()) {
+                keyID = it->second;
+                fRecovered = true;
+            }
+        }
+    }
+
+    if (!fRecovered) {
+        CPubKey pubkey2;
+        if (pubkey2.RecoverCompact(hash, vchSig))
+            keyID = pubkey2.GetID();
+    }
+
+    if (keyID == CKeyID()) {
         errorMessage = _("Error recovering public key.");
         return false;
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CDarKsendSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CDarKsendSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    return (keyID == pubkey.GetID());
+}
+
+/** Closure representing one signer recovery, for the signature check threads */
+class CSignatureCheck
+{
+private:
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    CKeyID* pkeyID;
+
+public:
+    CSignatureCheck() : pkeyID(NULL) {}
+    CSignatureCheck(const uint256& hashIn, const std::vector<unsigned char>& vchSigIn, CKeyID* pkeyIDIn) : hash(hashIn), vchSig(vchSigIn), pkeyID(pkeyIDIn) {}
+
+    bool operator()()
+    {
+        // a failed recovery leaves the null key id, VerifyMessage reports it
+        CPubKey pubkey;
+        if (pubkey.RecoverCompact(hash, vchSig))
+            *pkeyID = pubkey.GetID();
+        return true;
+    }
+
+    void swap(CSignatureCheck& check)
+    {
+        std::swap(hash, check.hash);
+        vchSig.swap(check.vchSig);
+        std::swap(pkeyID, check.pkeyID);
+    }
+};
+
+static CCheckQueue<CSignatureCheck> sigcheckqueue(16);
+// only one batch may use the queue at a time
+static CCriticalSection cs_sigcheckqueue;
+
+void ThreadSignatureCheck()
+{
+    RenameThread("salvage-sigcheck");
+    sigcheckqueue.Thread();
+}
+
+void CDarKsendSigner::RecoverBatch(const std::vector<std::pair<std::string, std::vector<unsigned char> > >& vMessages)
+{
+    // without worker threads there is nothing to gain, VerifyMessage recovers on demand
+    if (nScriptCheckThreads == 0 || vMessages.size() < 2)
+        return;
+
+    std::vector<uint256> vHashes;
+    std::vector<CKeyID> vKeyIDs(vMessages.size());
+    std::vector<CSignatureCheck> vChecks;
+    vHashes.reserve(vMessages.size());
+    vChecks.reserve(vMessages.size());
+    for (unsigned int i = 0; i < vMessages.size(); i++) {
+        vHashes.push_back(GetMessageHash(vMessages[i].first));
+        vChecks.push_back(CSignatureCheck(vHashes[i], vMessages[i].second, &vKeyIDs[i]));
+    }
+
+    {
+        LOCK(cs_sigcheckqueue);
+        CCheckQueueControl<CSignatureCheck> control(&sigcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    LOCK(cs);
+    for (unsigned int i = 0; i < vMessages.size(); i++) {
+        const std::vector<unsigned char>& vchSig = vMessages[i].second;
+        mapRecovered[Hash(vHashes[i].begin(), vHashes[i].end(), vchSig.begin(), vchSig.end())] = vKeyIDs[i];
+    }
+}
+
+void CDarKsendSigner::ClearRecovered(const std::vector<std::pair<std::string, std::vector<unsigned char> > >& vMessages)
+{
+    LOCK(cs);
+    if (mapRecovered.empty()) return;
+
+    for (unsigned int i = 0; i < vMessages.size(); i++) {
+        uint256 hash = GetMessageHash(vMessages[i].first);
+        const std::vector<unsigned char>& vchSig = vMessages[i].second;
+        mapRecovered.erase(Hash(hash.begin(), hash.end(), vchSig.begin(), vchSig.end()));
+    }
 }
 
 bool CDarksendQueue::Sign()
@@ -2295,6 +2402,9 @@ void ThreadCheckDarKsendPool()
         MilliSleep(1000);
         //LogPrintf("ThreadCheckDarKsendPool::check timeout\n");
 
+        // announces of a peer that went quiet mid-batch
+        mnodeman.ProcessPendingAnnounces();
+
         // try to sync from all available nodes, one step at a time
         masternodeSync.Process();
 
@@ -2312,7 +2422,12 @@ void ThreadCheckDarKsendPool()
                 CleanTransactionLocksList();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
+            // snapshot the caches regularly, so a crash does not lose everything since startup
+            if (c % MASTERNODES_DUMP_SECONDS == 0) {
+                DumpMasternodes();
+                DumpBudgets();
+                DumpMasternodePayments();
+            }
 
             DarKsendPool.CheckTimeout();
             DarKsendPool.CheckForCompleteQueue();
@@ -248,6 +248,11 @@ public:
  */
 class CDarKsendSigner
 {
+private:
+    CCriticalSection cs;
+    // signer key ids recovered ahead by RecoverBatch, keyed by the hash of message hash and signature
+    std::map<uint256, CKeyID> mapRecovered;
+
 public:
     /// Is the inputs associated with this public key? (and there is 10000 SVG - checking if valid masternode)
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
@@ -259,6 +264,10 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Recover the signers of (message, signature) pairs in parallel, for the next VerifyMessage calls to use
+    void RecoverBatch(const std::vector<std::pair<std::string, std::vector<unsigned char> > >& vMessages);
+    /// Forget the signers of one batch that were not looked up, leaving other batches' signers in place
+    void ClearRecovered(const std::vector<std::pair<std::string, std::vector<unsigned char> > >& vMessages);
 };
 
 /** Used to keep track of current status of Darksend pool
@@ -515,4 +524,7 @@ public:
 
 void ThreadCheckDarKsendPool();
 
+/** Run an instance of the masternode message signature check thread */
+void ThreadSignatureCheck();
+
 #endif
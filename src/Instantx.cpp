@@ -13,10 +13,14 @@
 #include "sync.h"
 #include "util.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
 
+CCriticalSection cs_instantx;
+CInstantXLockEngine instantXLocks;
+
 std::map<uint256, CTransaction> mapTxLockReq;
 std::map<uint256, CTransaction> mapTxLockReqRejected;
 std::map<uint256, CConsensusVote> mapTxLockVote;
@@ -25,6 +29,14 @@ std::map<COutPoint, uint256> mapLockedInputs;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// mapTxLocks ordered by expiration, so CleanTransactionLocksList only visits expired locks. Protected by cs_instantx
+static std::set<std::pair<int64_t, uint256> > setTxLockExpirations;
+// sum of mapUnknownVotes, for GetAverageVoteTime
+static int64_t nUnknownVotesTotal = 0;
+
+// upper bounds of the lock time histogram buckets in milliseconds, the last bucket is open
+static const int64_t nLockTimeBounds[INSTANTX_LOCK_TIME_BUCKETS] = {250, 500, 1000, 2000, 5000, 10000, 30000, 0};
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -47,8 +59,11 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
-            return;
+        {
+            LOCK(cs_instantx);
+            if (mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())) {
+                return;
+            }
         }
 
         if (!IsIXTXValid(tx)) {
@@ -64,14 +79,16 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             }
         }
 
-        int nBlockHeight = CreateNewLock(tx);
+        instantXLocks.RequestReceived(tx.GetHash());
 
         bool fMissingInputs = false;
         CValidationState state;
 
+        int nBlockHeight = 0;
         bool fAccepted = false;
         {
             LOCK(cs_main);
+            nBlockHeight = CreateNewLock(tx);
             fAccepted = AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs);
         }
         if (fAccepted) {
@@ -79,7 +96,10 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            {
+                LOCK(cs_instantx);
+                mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            }
 
             LogPrintf("ProcessMessageInstantX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -88,35 +108,41 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            bool fReprocess = false;
+            {
+                LOCK(cs_instantx);
+                mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
 
-            // can we get the conflicting transaction as proof?
+                // can we get the conflicting transaction as proof?
 
-            LogPrintf("ProcessMessageInstantX::ix - Transaction Lock Request: %s %s : rejected %s\n",
-                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
-                tx.GetHash().ToString().c_str());
+                LogPrintf("ProcessMessageInstantX::ix - Transaction Lock Request: %s %s : rejected %s\n",
+                    pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
+                    tx.GetHash().ToString().c_str());
 
-            BOOST_FOREACH (const CTxIn& in, tx.vin) {
-                if (!mapLockedInputs.count(in.prevout)) {
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+                BOOST_FOREACH (const CTxIn& in, tx.vin) {
+                    if (!mapLockedInputs.count(in.prevout)) {
+                        mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
+                    }
                 }
-            }
 
-            // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()) {
-                //we only care if we have a complete tx lock
-                if ((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED) {
-                    if (!CheckForConflictingLocks(tx)) {
-                        LogPrintf("ProcessMessageInstantX::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                // resolve conflicts
+                std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
+                if (i != mapTxLocks.end()) {
+                    //we only care if we have a complete tx lock
+                    if ((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED) {
+                        if (!CheckForConflictingLocks(tx)) {
+                            LogPrintf("ProcessMessageInstantX::ix - Found Existing Complete IX Lock\n");
+                            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+                            fReprocess = true;
+                        }
                     }
                 }
             }
 
+            //reprocess the last 15 blocks, this takes cs_main
+            if (fReprocess)
+                ReprocessBlocks(15);
+
             return;
         }
     } else if (strCommand == "txlvote") //InstantX Lock Consensus Votes
@@ -127,37 +153,18 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if (mapTxLockVote.count(ctx.GetHash())) {
-            return;
-        }
-
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
-
-        if (ProcessConsensusVote(pfrom, ctx)) {
-            //Spam/Dos protection
-            /*
-                Masternodes will sometimes propagate votes before the transaction is known to the client.
-                This tracks those messages and allows it at the same rate of the rest of the network, if
-                a peer violates it, it will simply be ignored
-            */
-            if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
-                if (!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)) {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
-
-                if (mapUnknownVotes[ctx.vinMasternode.prevout.hash] > GetTime() &&
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] - GetAverageVoteTime() > 60 * 10) {
-                    LogPrintf("ProcessMessageInstantX::ix - masternode is spamming transaction votes: %s %s\n",
-                        ctx.vinMasternode.ToString().c_str(),
-                        ctx.txHash.ToString().c_str());
-                    return;
-                } else {
-                    mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime() + (60 * 10);
-                }
+        {
+            LOCK(cs_instantx);
+            if (mapTxLockVote.count(ctx.GetHash())) {
+                return;
             }
-            RelayInv(inv);
+
+            mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
         }
 
+        // the voter and the signature are checked on the lock thread
+        instantXLocks.Push(pfrom, ctx);
+
         return;
     }
 }
@@ -211,6 +218,8 @@ bool IsIXTXValid(const CTransaction& txCollateral)
 
 int64_t CreateNewLock(CTransaction tx)
 {
+    AssertLockHeld(cs_main);
+
     int64_t nTxAge = 0;
     BOOST_REVERSE_FOREACH (CTxIn i, tx.vin) {
         nTxAge = GetInputAge(i);
@@ -228,6 +237,7 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge) + 4;
 
+    LOCK(cs_instantx);
     if (!mapTxLocks.count(tx.GetHash())) {
         LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
 
@@ -237,6 +247,7 @@ int64_t CreateNewLock(CTransaction tx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = tx.GetHash();
         mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
+        setTxLockExpirations.insert(make_pair((int64_t)newLock.nExpiration, newLock.txHash));
     } else {
         mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
         LogPrint("Instantx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
@@ -281,39 +292,54 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    {
+        LOCK(cs_instantx);
+        mapTxLockVote[ctx.GetHash()] = ctx;
+    }
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
     RelayInv(inv);
 }
 
-//received a consensus vote
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
+// relay a vote that was applied, unless its masternode is spamming votes, requires cs_instantx
+static void RelayConsensusVote(const CConsensusVote& ctx)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    AssertLockHeld(cs_instantx);
 
-    CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
-    if (pmn != NULL)
-        LogPrint("Instantx", "InstantX::ProcessConsensusVote - Masternode ADDR %s %d\n", pmn->addr.ToString().c_str(), n);
+    //Spam/Dos protection
+    /*
+        Masternodes will sometimes propagate votes before the transaction is known to the client.
+        This tracks those messages and allows it at the same rate of the rest of the network, if
+        a peer violates it, it will simply be ignored
+    */
+    if (!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)) {
+        std::map<uint256, int64_t>::iterator it = mapUnknownVotes.find(ctx.vinMasternode.prevout.hash);
+        if (it == mapUnknownVotes.end()) {
+            it = mapUnknownVotes.insert(make_pair(ctx.vinMasternode.prevout.hash, GetTime() + (60 * 10))).first;
+            nUnknownVotesTotal += it->second;
+        }
 
-    if (n == -1) {
-        //can be caused by past versions trying to vote with an invalid protocol
-        LogPrint("Instantx", "InstantX::ProcessConsensusVote - Unknown Masternode\n");
-        mnodeman.AskForMN(pnode, ctx.vinMasternode);
-        return false;
+        if (it->second > GetTime() &&
+            it->second - GetAverageVoteTime() > 60 * 10) {
+            LogPrintf("ProcessMessageInstantX::ix - masternode is spamming transaction votes: %s %s\n",
+                ctx.vinMasternode.ToString().c_str(),
+                ctx.txHash.ToString().c_str());
+            return;
+        } else {
+            nUnknownVotesTotal -= it->second;
+            it->second = GetTime() + (60 * 10);
+            nUnknownVotesTotal += it->second;
+        }
     }
 
-    if (n > INSTANTX_SIGNATURES_TOTAL) {
-        LogPrint("Instantx", "InstantX::ProcessConsensusVote - Masternode not in the top %d (%d) - %s\n", INSTANTX_SIGNATURES_TOTAL, n, ctx.GetHash().ToString().c_str());
-        return false;
-    }
+    CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
+    RelayInv(inv);
+}
 
-    if (!ctx.SignatureValid()) {
-        LogPrintf("InstantX::ProcessConsensusVote - Signature invalid\n");
-        // don't ban, it could just be a non-synced masternode
-        mnodeman.AskForMN(pnode, ctx.vinMasternode);
-        return false;
-    }
+//received a consensus vote, the voter is in the quorum and the signature was verified, requires cs_instantx
+bool ProcessConsensusVote(CConsensusVote& ctx, CInstantXUpdates& updates)
+{
+    AssertLockHeld(cs_instantx);
 
     if (!mapTxLocks.count(ctx.txHash)) {
         LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
@@ -324,6 +350,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         newLock.nTimeout = GetTime() + (60 * 5);
         newLock.txHash = ctx.txHash;
         mapTxLocks.insert(make_pair(ctx.txHash, newLock));
+        setTxLockExpirations.insert(make_pair((int64_t)newLock.nExpiration, newLock.txHash));
     } else
         LogPrint("Instantx", "InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
 
@@ -331,29 +358,20 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
     if (i != mapTxLocks.end()) {
         (*i).second.AddSignature(ctx);
+        instantXLocks.VoteApplied(ctx.txHash);
 
-#ifdef ENABLE_WALLET
-        if (pwalletMain) {
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if (pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
-#endif
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        updates.vVoted.push_back(ctx.txHash);
 
         LogPrint("Instantx", "InstantX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
 
         if ((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED) {
             LogPrint("Instantx", "InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+            instantXLocks.LockCompleted(ctx.txHash);
 
             CTransaction& tx = mapTxLockReq[ctx.txHash];
             if (!CheckForConflictingLocks(tx)) {
-#ifdef ENABLE_WALLET
-                if (pwalletMain) {
-                    if (pwalletMain->UpdatedTransaction((*i).second.txHash)) {
-                        nCompleteTXLocks++;
-                    }
-                }
-#endif
+                updates.vCompleted.push_back((*i).second.txHash);
 
                 if (mapTxLockReq.count(ctx.txHash)) {
                     BOOST_FOREACH (const CTxIn& in, tx.vin) {
@@ -367,8 +385,7 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 
                 //if this tx lock was rejected, we need to remove the conflicting blocks
                 if (mapTxLockReqRejected.count((*i).second.txHash)) {
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
+                    updates.fReprocess = true;
                 }
             }
         }
@@ -379,8 +396,45 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
     return false;
 }
 
+void ApplyInstantXUpdates(const CInstantXUpdates& updates)
+{
+#ifdef ENABLE_WALLET
+    if (pwalletMain) {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_FOREACH (const uint256& txHash, updates.vVoted) {
+            if (pwalletMain->mapRequestCount.count(txHash))
+                pwalletMain->mapRequestCount[txHash]++;
+        }
+        BOOST_FOREACH (const uint256& txHash, updates.vCompleted) {
+            if (pwalletMain->UpdatedTransaction(txHash)) {
+                nCompleteTXLocks++;
+            }
+        }
+    }
+#endif
+
+    //reprocess the last 15 blocks
+    if (updates.fReprocess)
+        ReprocessBlocks(15);
+}
+
+// expire a lock now, keeping setTxLockExpirations in step, requires cs_instantx
+static void ExpireTransactionLock(const uint256& txHash)
+{
+    AssertLockHeld(cs_instantx);
+
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if (it == mapTxLocks.end()) return;
+
+    setTxLockExpirations.erase(make_pair((int64_t)it->second.nExpiration, txHash));
+    it->second.nExpiration = GetTime();
+    setTxLockExpirations.insert(make_pair((int64_t)it->second.nExpiration, txHash));
+}
+
 bool CheckForConflictingLocks(CTransaction& tx)
 {
+    AssertLockHeld(cs_instantx);
+
     /*
         It's possible (very unlikely though) to get 2 conflicting transaction locks approved by the network.
         In that case, they will cancel each other out.
@@ -389,13 +443,12 @@ bool CheckForConflictingLocks(CTransaction& tx)
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
     BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if (mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if (mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
-            }
+        std::map<COutPoint, uint256>::iterator it = mapLockedInputs.find(in.prevout);
+        if (it != mapLockedInputs.end() && it->second != tx.GetHash()) {
+            LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), it->second.ToString().c_str());
+            ExpireTransactionLock(tx.GetHash());
+            ExpireTransactionLock(it->second);
+            return true;
         }
     }
 
@@ -404,46 +457,46 @@ bool CheckForConflictingLocks(CTransaction& tx)
 
 int64_t GetAverageVoteTime()
 {
-    std::map<uint256, int64_t>::iterator it = mapUnknownVotes.begin();
-    int64_t total = 0;
-    int64_t count = 0;
-
-    while (it != mapUnknownVotes.end()) {
-        total += it->second;
-        count++;
-        it++;
-    }
+    if (mapUnknownVotes.empty()) return 0;
 
-    return total / count;
+    return nUnknownVotesTotal / (int64_t)mapUnknownVotes.size();
 }
 
 void CleanTransactionLocksList()
 {
     if (chainActive.Tip() == NULL) return;
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    instantXLocks.Clean();
 
-    while (it != mapTxLocks.end()) {
-        if (GetTime() > it->second.nExpiration) { //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    LOCK(cs_instantx);
 
-            if (mapTxLockReq.count(it->second.txHash)) {
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+    //keep them for an hour
+    while (!setTxLockExpirations.empty() && GetTime() > setTxLockExpirations.begin()->first) {
+        uint256 txHash = setTxLockExpirations.begin()->second;
+        setTxLockExpirations.erase(setTxLockExpirations.begin());
 
-                BOOST_FOREACH (const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if (it == mapTxLocks.end()) continue;
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+        LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
 
-                BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
+        std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(txHash);
+        if (itReq != mapTxLockReq.end()) {
+            // only release the inputs this transaction holds, a conflicting lock may hold others
+            BOOST_FOREACH (const CTxIn& in, itReq->second.vin) {
+                std::map<COutPoint, uint256>::iterator itInput = mapLockedInputs.find(in.prevout);
+                if (itInput != mapLockedInputs.end() && itInput->second == txHash)
+                    mapLockedInputs.erase(itInput);
             }
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+            mapTxLockReq.erase(itReq);
+            mapTxLockReqRejected.erase(txHash);
+
+            BOOST_FOREACH (CConsensusVote& v, it->second.vecConsensusVotes)
+                mapTxLockVote.erase(v.GetHash());
         }
+
+        mapTxLocks.erase(it);
     }
 }
 
@@ -452,11 +505,15 @@ uint256 CConsensusVote::GetHash() const
     return vinMasternode.prevout.hash + vinMasternode.prevout.n + txHash;
 }
 
+std::string CConsensusVote::GetStrMessage() const
+{
+    return txHash.ToString() + boost::lexical_cast<std::string>(nBlockHeight);
+}
 
 bool CConsensusVote::SignatureValid()
 {
     std::string errorMessage;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("verify strMessage %s \n", strMessage.c_str());
 
     CMasternode* pmn = mnodeman.Find(vinMasternode);
@@ -480,7 +537,7 @@ bool CConsensusVote::Sign()
 
     CKey key2;
     CPubKey pubkey2;
-    std::string strMessage = txHash.ToString().c_str() + boost::lexical_cast<std::string>(nBlockHeight);
+    std::string strMessage = GetStrMessage();
     //LogPrintf("signing strMessage %s \n", strMessage.c_str());
     //LogPrintf("signing privkey %s \n", strMasterNodePrivKey.c_str());
 
@@ -549,3 +606,217 @@ int CTransactionLock::CountSignatures()
     }
     return n;
 }
+
+CInstantXLockEngine::CInstantXLockEngine() : nVoteTimesTotal(0)
+{
+    for (int i = 0; i < INSTANTX_LOCK_TIME_BUCKETS; i++)
+        vLockTimes[i] = 0;
+}
+
+const CInstantXLockEngine::CQuorum& CInstantXLockEngine::GetQuorum(int nBlockHeight)
+{
+    std::map<int, CQuorum>::iterator it = mapQuorums.find(nBlockHeight);
+    if (it != mapQuorums.end() && GetTime() - it->second.nTimeCreated < MASTERNODES_RANK_CACHE_SECONDS)
+        return it->second;
+
+    CQuorum& quorum = mapQuorums[nBlockHeight];
+    quorum.nTimeCreated = GetTime();
+    mnodeman.GetTopMasternodes(nBlockHeight, MIN_INSTANTX_PROTO_VERSION, INSTANTX_SIGNATURES_TOTAL, quorum.mapMembers);
+    return quorum;
+}
+
+void CInstantXLockEngine::Push(CNode* pfrom, const CConsensusVote& vote)
+{
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+
+    CPendingVote pending;
+    pending.pfrom = pfrom;
+    pending.vote = vote;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    vecPending.push_back(pending);
+    condVotes.notify_one();
+}
+
+void CInstantXLockEngine::ProcessPending()
+{
+    CInstantXUpdates updates;
+    {
+        LOCK(cs_process);
+        ProcessVotes(updates);
+    }
+    ApplyInstantXUpdates(updates);
+}
+
+void CInstantXLockEngine::ProcessVotes(CInstantXUpdates& updates)
+{
+    std::vector<CPendingVote> vecVotes;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        vecVotes.swap(vecPending);
+    }
+    if (vecVotes.empty()) return;
+
+    // find the key each voter signs with, votes from outside the quorum are not verified at all
+    std::vector<CPubKey> vPubKeys(vecVotes.size());
+    std::vector<std::pair<std::string, std::vector<unsigned char> > > vMessages;
+    for (unsigned int i = 0; i < vecVotes.size(); i++) {
+        const CConsensusVote& ctx = vecVotes[i].vote;
+        const CQuorum& quorum = GetQuorum(ctx.nBlockHeight);
+        std::map<COutPoint, CPubKey>::const_iterator it = quorum.mapMembers.find(ctx.vinMasternode.prevout);
+        if (it == quorum.mapMembers.end()) continue;
+
+        vPubKeys[i] = it->second;
+        vMessages.push_back(make_pair(ctx.GetStrMessage(), ctx.vchMasterNodeSignature));
+    }
+
+    // recover all signers up front, VerifyMessage below then finds them ready
+    DarKsendSigner.RecoverBatch(vMessages);
+
+    for (unsigned int i = 0; i < vecVotes.size(); i++) {
+        CNode* pfrom = vecVotes[i].pfrom;
+        CConsensusVote& ctx = vecVotes[i].vote;
+
+        if (!vPubKeys[i].IsValid()) {
+            if (mnodeman.Find(ctx.vinMasternode) == NULL) {
+                //can be caused by past versions trying to vote with an invalid protocol
+                LogPrint("Instantx", "InstantX::ProcessPending - Unknown Masternode\n");
+                mnodeman.AskForMN(pfrom, ctx.vinMasternode);
+            } else {
+                LogPrint("Instantx", "InstantX::ProcessPending - Masternode not in the top %d - %s\n", INSTANTX_SIGNATURES_TOTAL, ctx.GetHash().ToString().c_str());
+            }
+            continue;
+        }
+
+        std::string errorMessage;
+        if (!DarKsendSigner.VerifyMessage(vPubKeys[i], ctx.vchMasterNodeSignature, ctx.GetStrMessage(), errorMessage)) {
+            LogPrintf("InstantX::ProcessPending - Signature invalid\n");
+            // don't ban, it could just be a non-synced masternode
+            mnodeman.AskForMN(pfrom, ctx.vinMasternode);
+            continue;
+        }
+
+        LOCK(cs_instantx);
+        if (ProcessConsensusVote(ctx, updates))
+            RelayConsensusVote(ctx);
+    }
+
+    DarKsendSigner.ClearRecovered(vMessages);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CPendingVote& pending, vecVotes)
+            pending.pfrom->Release();
+    }
+}
+
+void CInstantXLockEngine::Thread()
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vecPending.empty())
+                condVotes.wait(lock);
+        }
+
+        try {
+            ProcessPending();
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "CInstantXLockEngine::Thread()");
+        }
+    }
+}
+
+void CInstantXLockEngine::RequestReceived(const uint256& txHash)
+{
+    LOCK(cs_stats);
+    if (!mapRequestTimes.count(txHash))
+        mapRequestTimes[txHash] = GetTimeMillis();
+}
+
+void CInstantXLockEngine::VoteApplied(const uint256& txHash)
+{
+    LOCK(cs_stats);
+    std::map<uint256, int64_t>::iterator it = mapRequestTimes.find(txHash);
+    if (it == mapRequestTimes.end()) return;
+
+    int64_t nElapsed = GetTimeMillis() - it->second;
+    vecVoteTimes.push_back(nElapsed);
+    nVoteTimesTotal += nElapsed;
+    if (vecVoteTimes.size() > INSTANTX_VOTE_TIME_WINDOW) {
+        nVoteTimesTotal -= vecVoteTimes.front();
+        vecVoteTimes.pop_front();
+    }
+}
+
+void CInstantXLockEngine::LockCompleted(const uint256& txHash)
+{
+    LOCK(cs_stats);
+    std::map<uint256, int64_t>::iterator it = mapRequestTimes.find(txHash);
+    if (it == mapRequestTimes.end()) return;
+
+    int64_t nElapsed = GetTimeMillis() - it->second;
+    mapRequestTimes.erase(it);
+
+    int nBucket = 0;
+    while (nBucket < INSTANTX_LOCK_TIME_BUCKETS - 1 && nElapsed > nLockTimeBounds[nBucket])
+        nBucket++;
+    vLockTimes[nBucket]++;
+
+    LogPrint("Instantx", "CInstantXLockEngine::LockCompleted - %s locked after %dms\n", txHash.ToString(), nElapsed);
+}
+
+void CInstantXLockEngine::Clean()
+{
+    {
+        LOCK(cs_process);
+        std::map<int, CQuorum>::iterator it = mapQuorums.begin();
+        while (it != mapQuorums.end()) {
+            if (GetTime() - it->second.nTimeCreated >= MASTERNODES_RANK_CACHE_SECONDS)
+                mapQuorums.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    // requests that did not lock within the lock timeout never will
+    LOCK(cs_stats);
+    std::map<uint256, int64_t>::iterator it2 = mapRequestTimes.begin();
+    while (it2 != mapRequestTimes.end()) {
+        if (GetTimeMillis() - it2->second > 60 * 60 * 1000)
+            mapRequestTimes.erase(it2++);
+        else
+            ++it2;
+    }
+}
+
+void CInstantXLockEngine::GetLockTimes(std::vector<std::pair<int64_t, int64_t> >& vLockTimesRet, int& nPendingRet)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nPendingRet = vecPending.size();
+    }
+
+    LOCK(cs_stats);
+    vLockTimesRet.clear();
+    for (int i = 0; i < INSTANTX_LOCK_TIME_BUCKETS; i++)
+        vLockTimesRet.push_back(make_pair(nLockTimeBounds[i], vLockTimes[i]));
+}
+
+void CInstantXLockEngine::GetVoteTimes(int& nVotesRet, int64_t& nAverageRet)
+{
+    LOCK(cs_stats);
+    nVotesRet = vecVoteTimes.size();
+    nAverageRet = vecVoteTimes.empty() ? 0 : nVoteTimesTotal / (int64_t)vecVoteTimes.size();
+}
+
+void ThreadInstantXLocks()
+{
+    if (fLiteMode) return; //disable all Darksend/masternode related functionality
+
+    RenameThread("salvage-ixlock");
+    instantXLocks.Thread();
+}
@@ -16,6 +16,11 @@
 #include "sync.h"
 #include "util.h"
 
+#include <deque>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of InstantX
@@ -28,6 +33,11 @@
 #define INSTANTX_SIGNATURES_REQUIRED 6
 #define INSTANTX_SIGNATURES_TOTAL 10
 
+// number of buckets in the request to lock time histogram, see CInstantXLockEngine
+#define INSTANTX_LOCK_TIME_BUCKETS 8
+// number of recent votes the average vote time is taken over
+#define INSTANTX_VOTE_TIME_WINDOW 1000
+
 using namespace std;
 using namespace boost;
 
@@ -37,6 +47,9 @@ class CTransactionLock;
 
 static const int MIN_INSTANTX_PROTO_VERSION = 70103;
 
+// protects the transaction lock maps below. Lock order: cs_main, then cs_wallet, then cs_instantx;
+// nothing that takes cs_main or cs_wallet may be called while holding cs_instantx
+extern CCriticalSection cs_instantx;
 extern map<uint256, CTransaction> mapTxLockReq;
 extern map<uint256, CTransaction> mapTxLockReqRejected;
 extern map<uint256, CConsensusVote> mapTxLockVote;
@@ -45,11 +58,24 @@ extern std::map<COutPoint, uint256> mapLockedInputs;
 extern int nCompleteTXLocks;
 
 
+// Wallet and chain updates called for by votes applied under cs_instantx, made once it is released
+struct CInstantXUpdates {
+    // transactions that received a vote, the wallet counts these as requests
+    std::vector<uint256> vVoted;
+    // locks that completed without conflict
+    std::vector<uint256> vCompleted;
+    // a rejected transaction was locked, blocks conflicting with it have to be reprocessed
+    bool fReprocess;
+
+    CInstantXUpdates() : fReprocess(false) {}
+};
+
+// requires cs_main, takes cs_instantx
 int64_t CreateNewLock(CTransaction tx);
 
 bool IsIXTXValid(const CTransaction& txCollateral);
 
-// if two conflicting locks are approved by the network, they will cancel out
+// if two conflicting locks are approved by the network, they will cancel out, requires cs_instantx
 bool CheckForConflictingLocks(CTransaction& tx);
 
 void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
@@ -57,8 +83,11 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
 //check if we need to vote on this transaction
 void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 
-//process consensus vote message
-bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx);
+//apply a consensus vote whose voter and signature were verified, requires cs_instantx
+bool ProcessConsensusVote(CConsensusVote& ctx, CInstantXUpdates& updates);
+
+//make the updates of ProcessConsensusVote, takes cs_wallet and cs_main so must not be called with cs_instantx held
+void ApplyInstantXUpdates(const CInstantXUpdates& updates);
 
 // keep transaction locks in memory for an hour
 void CleanTransactionLocksList();
@@ -74,6 +103,7 @@ public:
     std::vector<unsigned char> vchMasterNodeSignature;
 
     uint256 GetHash() const;
+    std::string GetStrMessage() const;
 
     bool SignatureValid();
     bool Sign();
@@ -109,5 +139,94 @@ public:
     }
 };
 
+/**
+ * Verifies "txlvote" messages off the message handler thread.
+ *
+ * The message handler only drops votes it has seen before and queues the rest. The lock
+ * thread takes everything queued so far, looks each voter up in the cached top
+ * INSTANTX_SIGNATURES_TOTAL masternodes of the vote's height, recovers all signers in one
+ * parallel batch and then applies the votes in order, so a lock completes as soon as its
+ * INSTANTX_SIGNATURES_REQUIRED-th vote is verified.
+ */
+class CInstantXLockEngine
+{
+private:
+    struct CPendingVote {
+        CNode* pfrom;
+        CConsensusVote vote;
+    };
+
+    // top masternodes of one block height and the keys their votes are checked against
+    struct CQuorum {
+        int64_t nTimeCreated;
+        std::map<COutPoint, CPubKey> mapMembers;
+    };
+
+    //! Mutex to protect vecPending
+    boost::mutex mutex;
+
+    //! The lock thread blocks on this while no votes are queued
+    boost::condition_variable condVotes;
+
+    //! Votes waiting for verification, each holding a reference to its node
+    std::vector<CPendingVote> vecPending;
+
+    //! Only one batch is processed at a time
+    CCriticalSection cs_process;
+
+    //! Quorums by block height, rebuilt after MASTERNODES_RANK_CACHE_SECONDS. Protected by cs_process
+    std::map<int, CQuorum> mapQuorums;
+
+    //! Protects the lock time statistics
+    CCriticalSection cs_stats;
+    //! When each pending lock was requested, in milliseconds
+    std::map<uint256, int64_t> mapRequestTimes;
+    //! Count of completed locks per request to lock time bucket
+    int64_t vLockTimes[INSTANTX_LOCK_TIME_BUCKETS];
+    //! Time from request to vote of the last INSTANTX_VOTE_TIME_WINDOW votes, in milliseconds, and their sum
+    std::deque<int64_t> vecVoteTimes;
+    int64_t nVoteTimesTotal;
+
+    const CQuorum& GetQuorum(int nBlockHeight);
+
+    //! Verify and apply the queued votes, requires cs_process
+    void ProcessVotes(CInstantXUpdates& updates);
+
+public:
+    CInstantXLockEngine();
+
+    //! Queue a vote; the node is referenced until the vote has been processed
+    void Push(CNode* pfrom, const CConsensusVote& vote);
+
+    //! Verify and apply all queued votes; takes cs_main and cs_wallet, so must not be called holding them
+    void ProcessPending();
+
+    //! Lock thread loop
+    void Thread();
+
+    //! A lock request was received or sent, start its clock
+    void RequestReceived(const uint256& txHash);
+
+    //! A vote for a requested lock was applied, record its time
+    void VoteApplied(const uint256& txHash);
+
+    //! A lock reached INSTANTX_SIGNATURES_REQUIRED votes, record its time
+    void LockCompleted(const uint256& txHash);
+
+    //! Forget old quorums and requests that never locked, must not be called holding cs_instantx
+    void Clean();
+
+    //! Upper bound in milliseconds (0 for the last, open bucket) and count of each histogram bucket
+    void GetLockTimes(std::vector<std::pair<int64_t, int64_t> >& vLockTimesRet, int& nPendingRet);
+
+    //! Number of recent votes and their average time from request to vote in milliseconds
+    void GetVoteTimes(int& nVotesRet, int64_t& nAverageRet);
+};
+
+extern CInstantXLockEngine instantXLocks;
+
+/** Run the InstantX vote verification thread */
+void ThreadInstantXLocks();
+
 
 #endif
@@ -70,9 +70,34 @@ double CAddrInfo::GetChance(int64_t nNow) const
     // deprioritize 66% after each failed attempt, but at most 1/28th to avoid the search taking forever or overly penalizing outages.
     fChance *= pow(0.66, min(nAttempts, 8));
 
+    // favour addresses that answered quickly and delivered blocks promptly in the past
+    fChance *= GetQuality();
+
     return fChance;
 }
 
+double CAddrInfo::GetQuality() const
+{
+    double fQuality = 1.0;
+
+    // a peer at the reference latency keeps factor 1, twice as fast approaches 2, far slower approaches 0.25
+    if (nPingUsec > 0)
+        fQuality *= max(0.25, 2.0 / (1.0 + (double)nPingUsec / ADDRMAN_REFERENCE_PING_USEC));
+
+    if (nBlocks > 0)
+        fQuality *= max(0.25, 2.0 / (1.0 + (double)nBlockUsec / ADDRMAN_REFERENCE_BLOCK_USEC));
+
+    return fQuality;
+}
+
+//! Blend a new latency sample into a moving average; the first sample is taken as is.
+static int64_t SmoothLatency(int64_t nAverage, int64_t nSample)
+{
+    if (nAverage <= 0)
+        return nSample;
+    return (nAverage * (8 - ADDRMAN_LATENCY_SAMPLE_WEIGHT) + nSample * ADDRMAN_LATENCY_SAMPLE_WEIGHT) / 8;
+}
+
 CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int* pnId)
 {
     std::map<CNetAddr, int>::iterator it = mapAddr.find(addr);
@@ -214,6 +239,7 @@ void CAddrMan::Good_(const CService& addr, int64_t nTime)
     info.nLastSuccess = nTime;
     info.nLastTry = nTime;
     info.nAttempts = 0;
+    info.nConnects++;
     // nTime is not updated here, to avoid leaking information about
     // currently-connected peers.
 
@@ -488,3 +514,40 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::UpdatePing_(const CService& addr, int64_t nPingUsec)
+{
+    CAddrInfo* pinfo = Find(addr);
+
+    // if not found, or not the exact same CService, bail out
+    if (!pinfo || *pinfo != addr || nPingUsec <= 0)
+        return;
+
+    pinfo->nPingUsec = SmoothLatency(pinfo->nPingUsec, nPingUsec);
+}
+
+void CAddrMan::BlockDelivered_(const CService& addr, int64_t nLatencyUsec)
+{
+    CAddrInfo* pinfo = Find(addr);
+
+    // if not found, or not the exact same CService, bail out
+    if (!pinfo || *pinfo != addr || nLatencyUsec < 0)
+        return;
+
+    pinfo->nBlockUsec = SmoothLatency(pinfo->nBlockUsec, nLatencyUsec);
+    pinfo->nBlocks++;
+}
+
+bool CAddrMan::GetStats_(const CService& addr, CAddrStats& stats)
+{
+    CAddrInfo* pinfo = Find(addr);
+
+    if (!pinfo || *pinfo != addr)
+        return false;
+
+    stats.nConnects = pinfo->nConnects;
+    stats.nPingUsec = pinfo->nPingUsec;
+    stats.nBlockUsec = pinfo->nBlockUsec;
+    stats.nBlocks = pinfo->nBlocks;
+    return true;
+}
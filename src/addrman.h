@@ -44,6 +44,18 @@ private:
     //! position in vRandom
     int nRandomPos;
 
+    //! number of successful outbound connections (memory only)
+    int nConnects;
+
+    //! smoothed ping round-trip time in microseconds, 0 if unknown (memory only)
+    int64_t nPingUsec;
+
+    //! smoothed time between block request and delivery in microseconds, 0 if unknown (memory only)
+    int64_t nBlockUsec;
+
+    //! number of requested blocks delivered (memory only)
+    int nBlocks;
+
     friend class CAddrMan;
 
 public:
@@ -66,6 +78,10 @@ public:
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
+        nConnects = 0;
+        nPingUsec = 0;
+        nBlockUsec = 0;
+        nBlocks = 0;
     }
 
     CAddrInfo(const CAddress& addrIn, const CNetAddr& addrSource) : CAddress(addrIn), source(addrSource)
@@ -98,6 +114,19 @@ public:
 
     //! Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
+
+    //! Calculate a preference factor from the measured ping and block delivery latency (1.0 if nothing is known)
+    double GetQuality() const;
+};
+
+/**
+ * Connection quality statistics recorded for an address
+ */
+struct CAddrStats {
+    int nConnects;
+    int64_t nPingUsec;
+    int64_t nBlockUsec;
+    int nBlocks;
 };
 
 /** Stochastic address manager
@@ -162,6 +191,15 @@ public:
 //! the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+//! ping time (in microseconds) at which an address is neither favoured nor penalized
+#define ADDRMAN_REFERENCE_PING_USEC 200000
+
+//! block delivery time (in microseconds) at which an address is neither favoured nor penalized
+#define ADDRMAN_REFERENCE_BLOCK_USEC 2000000
+
+//! weight (out of 8) given to a new latency sample in the moving average
+#define ADDRMAN_LATENCY_SAMPLE_WEIGHT 2
+
 /** 
  * Stochastical (IP) address manager 
  */
@@ -242,6 +280,15 @@ protected:
     //! Mark an entry as currently-connected-to.
     void Connected_(const CService& addr, int64_t nTime);
 
+    //! Record a ping round-trip measurement for an entry.
+    void UpdatePing_(const CService& addr, int64_t nPingUsec);
+
+    //! Record the delivery of a requested block by an entry.
+    void BlockDelivered_(const CService& addr, int64_t nLatencyUsec);
+
+    //! Fetch the connection quality statistics of an entry.
+    bool GetStats_(const CService& addr, CAddrStats& stats);
+
 public:
     /**
      * serialized format:
@@ -566,6 +613,35 @@ public:
             Check();
         }
     }
+
+    //! Record a ping round-trip measurement for an outbound peer.
+    void UpdatePing(const CService& addr, int64_t nPingUsec)
+    {
+        {
+            LOCK(cs);
+            Check();
+            UpdatePing_(addr, nPingUsec);
+            Check();
+        }
+    }
+
+    //! Record the delivery of a block we requested from an outbound peer.
+    void BlockDelivered(const CService& addr, int64_t nLatencyUsec)
+    {
+        {
+            LOCK(cs);
+            Check();
+            BlockDelivered_(addr, nLatencyUsec);
+            Check();
+        }
+    }
+
+    //! Get the connection quality statistics recorded for an address.
+    bool GetStats(const CService& addr, CAddrStats& stats)
+    {
+        LOCK(cs);
+        return GetStats_(addr, stats);
+    }
 };
 
 #endif // BITCOIN_ADDRMAN_H
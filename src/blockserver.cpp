@@ -0,0 +1,144 @@
+// Copyright (c) 2018 The Salvage developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockserver.h"
+
+#include "main.h"
+#include "merkleblock.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+CBlockServer blockServer;
+
+void PushBlock(CNode* pfrom, const CInv& inv, const CDiskBlockPos& pos, const uint256& hashContinue)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pos) || block.GetHash() != inv.hash)
+        assert(!"cannot load block from disk");
+
+    if (inv.type == MSG_BLOCK)
+        pfrom->PushMessage("block", block);
+    else // MSG_FILTERED_BLOCK)
+    {
+        vector<const CTransaction*> vMatchedTx;
+        {
+            LOCK(pfrom->cs_filter);
+            if (!pfrom->pfilter)
+                return; // no response
+            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+            pfrom->PushMessage("merkleblock", merkleBlock);
+            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+            // This avoids hurting performance by pointlessly requiring a round-trip
+            // Note that there is currently no way for a node to request any single transactions we didnt send here -
+            // they must either disconnect and retry or request the full block.
+            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+            // however we MUST always provide at least what the remote peer needs
+            {
+                LOCK(pfrom->cs_inventory);
+                typedef std::pair<unsigned int, uint256> PairType;
+                BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
+                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                        vMatchedTx.push_back(&block.vtx[pair.first]);
+            }
+        }
+        BOOST_FOREACH (const CTransaction* ptx, vMatchedTx)
+            pfrom->PushMessage("tx", *ptx);
+    }
+
+    // Trigger them to send a getblocks request for the next batch of inventory
+    if (hashContinue != 0) {
+        // Bypass PushInventory, this must send even if redundant,
+        // and we want it right after the last block so they don't
+        // wait for other stuff first.
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, hashContinue));
+        pfrom->PushMessage("inv", vInv);
+    }
+}
+
+bool CBlockServer::IsServing(NodeId nodeid)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapQueue.count(nodeid) || setBusy.count(nodeid);
+}
+
+void CBlockServer::Push(CNode* pnode, const CInv& inv, const CDiskBlockPos& pos, const uint256& hashContinue)
+{
+    {
+        LOCK(cs_vNodes);
+        pnode->AddRef();
+    }
+
+    CRequest req;
+    req.pnode = pnode;
+    req.inv = inv;
+    req.pos = pos;
+    req.hashContinue = hashContinue;
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    deque<CRequest>& queue = mapQueue[pnode->GetId()];
+    queue.push_back(req);
+    if (queue.size() == 1 && !setBusy.count(pnode->GetId())) {
+        vReady.push_back(pnode->GetId());
+        condWorker.notify_one();
+    }
+}
+
+void CBlockServer::Thread()
+{
+    while (true) {
+        CRequest req;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vReady.empty())
+                condWorker.wait(lock);
+            NodeId nodeid = vReady.front();
+            vReady.pop_front();
+            req = mapQueue[nodeid].front();
+            mapQueue[nodeid].pop_front();
+            setBusy.insert(nodeid);
+        }
+
+        if (!req.pnode->fDisconnect) {
+            try {
+                PushBlock(req.pnode, req.inv, req.pos, req.hashContinue);
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "CBlockServer::Thread()");
+            }
+        }
+
+        bool fDone = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            NodeId nodeid = req.pnode->GetId();
+            setBusy.erase(nodeid);
+            // go to the back of the line if there is more to serve for this peer
+            if (mapQueue[nodeid].empty()) {
+                mapQueue.erase(nodeid);
+                fDone = true;
+            } else {
+                vReady.push_back(nodeid);
+                condWorker.notify_one();
+            }
+        }
+        // the message handler holds back the rest of this peer's requests until now
+        if (fDone)
+            WakeMessageHandler();
+
+        {
+            LOCK(cs_vNodes);
+            req.pnode->Release();
+        }
+    }
+}
+
+void ThreadBlockServer()
+{
+    RenameThread("salvage-blockserve");
+    blockServer.Thread();
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2018 The Salvage developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSERVER_H
+#define BITCOIN_BLOCKSERVER_H
+
+#include "chain.h"
+#include "net.h"
+#include "protocol.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <set>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Default for -blockservethreads, 0 serves blocks on the message handler thread */
+static const int DEFAULT_BLOCK_SERVE_THREADS = 2;
+/** Maximum number of block serving threads */
+static const int MAX_BLOCK_SERVE_THREADS = 16;
+
+/**
+ * Send one block (or merkleblock) read from a position captured under cs_main.
+ * Does not need cs_main. If hashContinue is set, it is announced right after the block.
+ */
+void PushBlock(CNode* pfrom, const CInv& inv, const CDiskBlockPos& pos, const uint256& hashContinue);
+
+/**
+ * Pool of threads serving block getdata requests.
+ *
+ * ProcessGetData decides under cs_main whether a block may be sent and snapshots its
+ * disk position; reading, serializing and sending then happens here without cs_main,
+ * so a peer downloading the chain from us does not stall the message handler.
+ * Requests of one peer are served in order by at most one worker at a time, and
+ * peers with pending requests take turns one block each. The message handler does not
+ * answer anything else for a peer until its blocks are sent, to keep responses in order.
+ * Only nodes in vNodes may be queued, a reference does not keep any other node alive.
+ */
+class CBlockServer
+{
+private:
+    struct CRequest {
+        CNode* pnode;
+        CInv inv;
+        CDiskBlockPos pos;
+        uint256 hashContinue;
+    };
+
+    //! Mutex to protect the inner state
+    boost::mutex mutex;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! Pending requests per peer, each holding a reference to the node
+    std::map<NodeId, std::deque<CRequest> > mapQueue;
+
+    //! Peers with pending requests that no worker is serving, in turn order
+    std::deque<NodeId> vReady;
+
+    //! Peers currently being served by a worker
+    std::set<NodeId> setBusy;
+
+    //! Number of worker threads
+    int nThreads;
+
+public:
+    CBlockServer() : nThreads(0) {}
+
+    //! Set the number of worker threads that will run Thread()
+    void SetThreads(int n) { nThreads = n; }
+
+    //! Whether blocks are served by worker threads rather than inline
+    bool IsActive() const { return nThreads > 0; }
+
+    //! Whether blocks for a peer are waiting or being sent
+    bool IsServing(NodeId nodeid);
+
+    //! Queue a block request; the node is referenced until it has been served
+    void Push(CNode* pnode, const CInv& inv, const CDiskBlockPos& pos, const uint256& hashContinue);
+
+    //! Worker thread loop
+    void Thread();
+};
+
+extern CBlockServer blockServer;
+
+/** Run an instance of the block serving thread */
+void ThreadBlockServer();
+
+#endif // BITCOIN_BLOCKSERVER_H
@@ -0,0 +1,210 @@
+// Copyright (c) 2018 The Salvage developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef FLAT_DATABASE_H
+#define FLAT_DATABASE_H
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Snapshot file of one of the masternode managers (mncache.dat, mnpayments.dat, budget.dat).
+ *
+ * A file holds a magic message, the network magic number, the serialized object and a
+ * checksum of all of that. Snapshots are written to a temporary file which is committed
+ * and renamed over the previous one, so a crash while writing leaves the last snapshot intact.
+ */
+template <typename T>
+class CFlatDB
+{
+private:
+    boost::filesystem::path pathDB;
+    std::string strFilename;
+    std::string strMagicMessage;
+
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        HashReadError,
+        IncorrectHash,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+    CFlatDB(const std::string& strFilenameIn, const std::string& strMagicMessageIn)
+    {
+        pathDB = GetDataDir() / strFilenameIn;
+        strFilename = strFilenameIn;
+        strMagicMessage = strMagicMessageIn;
+    }
+
+    bool Write(const T& objToSave)
+    {
+        int64_t nStart = GetTimeMillis();
+
+        // serialize, checksum data up to that point, then append checksum
+        CDataStream ssObj(SER_DISK, CLIENT_VERSION);
+        ssObj << strMagicMessage;                   // file specific magic message
+        ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+        ssObj << objToSave;
+        uint256 hash = Hash(ssObj.begin(), ssObj.end());
+        ssObj << hash;
+
+        // write to a temporary file first, so there is always one complete snapshot on disk
+        boost::filesystem::path pathTmp(pathDB.string() + ".new");
+
+        FILE* file = fopen(pathTmp.string().c_str(), "wb");
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+        try {
+            fileout << ssObj;
+        } catch (std::exception& e) {
+            return error("%s : Serialize or I/O error - %s", __func__, e.what());
+        }
+        FileCommit(fileout.Get());
+        fileout.fclose();
+
+        if (!RenameOver(pathTmp, pathDB))
+            return error("%s : Rename-into-place failed for %s", __func__, pathDB.string());
+
+        LogPrintf("Written info to %s  %dms\n", strFilename, GetTimeMillis() - nStart);
+        LogPrintf("  %s\n", objToSave.ToString());
+
+        return true;
+    }
+
+    ReadResult Read(T& objToLoad)
+    {
+        int64_t nStart = GetTimeMillis();
+        // open input file, and associate with CAutoFile
+        FILE* file = fopen(pathDB.string().c_str(), "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            error("%s : Failed to open file %s", __func__, pathDB.string());
+            return FileError;
+        }
+
+        // use file size to size memory buffer
+        int fileSize = boost::filesystem::file_size(pathDB);
+        int dataSize = fileSize - sizeof(uint256);
+        // Don't try to resize to a negative number if file is small
+        if (dataSize < 0)
+            dataSize = 0;
+        std::vector<unsigned char> vchData;
+        vchData.resize(dataSize);
+        uint256 hashIn;
+
+        // read data and checksum from file
+        try {
+            filein.read((char*)&vchData[0], dataSize);
+            filein >> hashIn;
+        } catch (std::exception& e) {
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return HashReadError;
+        }
+        filein.fclose();
+
+        CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
+
+        // verify stored checksum matches input data
+        uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
+        if (hashIn != hashTmp) {
+            error("%s : Checksum mismatch, data corrupted", __func__);
+            return IncorrectHash;
+        }
+
+        try {
+            ReadResult result = ReadHeader(ssObj);
+            if (result != Ok)
+                return result;
+
+            // de-serialize data into the object
+            ssObj >> objToLoad;
+        } catch (std::exception& e) {
+            objToLoad.Clear();
+            error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            return IncorrectFormat;
+        }
+
+        LogPrintf("Loaded info from %s  %dms\n", strFilename, GetTimeMillis() - nStart);
+        LogPrintf("  %s\n", objToLoad.ToString());
+
+        return Ok;
+    }
+
+    /// Read into objToLoad and store the result, to load several files on separate threads
+    void Load(T& objToLoad, ReadResult& result)
+    {
+        result = Read(objToLoad);
+    }
+
+    /// Write objToSave, unless the existing file belongs to another network or program
+    bool Dump(const T& objToSave)
+    {
+        int64_t nStart = GetTimeMillis();
+
+        FILE* file = fopen(pathDB.string().c_str(), "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            LogPrintf("Missing file - %s, will try to recreate\n", strFilename);
+        } else {
+            ReadResult result;
+            try {
+                result = ReadHeader(filein);
+            } catch (std::exception& e) {
+                result = IncorrectFormat;
+            }
+            filein.fclose();
+            if (result == IncorrectMagicMessage || result == IncorrectMagicNumber) {
+                LogPrintf("Error reading %s: file format is unknown or invalid, please fix it manually\n", strFilename);
+                return false;
+            }
+        }
+
+        LogPrintf("Writing info to %s...\n", strFilename);
+        if (!Write(objToSave))
+            return false;
+
+        LogPrintf("%s dump finished  %dms\n", strFilename, GetTimeMillis() - nStart);
+        return true;
+    }
+
+private:
+    template <typename Stream>
+    ReadResult ReadHeader(Stream& s)
+    {
+        // de-serialize file header (file specific magic message) and ..
+        std::string strMagicMessageTmp;
+        s >> strMagicMessageTmp;
+
+        // ... verify the message matches predefined one
+        if (strMagicMessage != strMagicMessageTmp) {
+            error("%s : Invalid %s magic message", __func__, strFilename);
+            return IncorrectMagicMessage;
+        }
+
+        // de-serialize file header (network specific magic number) and ..
+        unsigned char pchMsgTmp[4];
+        s >> FLATDATA(pchMsgTmp);
+
+        // ... verify the network matches ours
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
+            error("%s : Invalid network magic number", __func__);
+            return IncorrectMagicNumber;
+        }
+
+        return Ok;
+    }
+};
+
+#endif // FLAT_DATABASE_H
@@ -16,9 +16,11 @@
 #include "activemasternode.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockserver.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "Instantx.h"
 #include "key.h"
 #include "main.h"
 #include "masternode-budget.h"
@@ -318,7 +320,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep at most <n> bytes of unconnectable transactions in memory, of which a single peer may use %u%% (default: %u)"), ORPHAN_TX_PEER_QUOTA_PCT, DEFAULT_MAX_ORPHAN_TX_SIZE));
+    strUsage += HelpMessageOpt("-blockservethreads=<n>", strprintf(_("Set the number of threads serving blocks to peers, 0 = serve from the message handler (0 to %d, default: %d)"), MAX_BLOCK_SERVE_THREADS, DEFAULT_BLOCK_SERVE_THREADS));
+    strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script and masternode signature verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "salvaged.pid"));
 #endif
@@ -339,6 +343,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)"));
     strUsage += HelpMessageOpt("-dnsseed", _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)"));
     strUsage += HelpMessageOpt("-externalip=<ip>", _("Specify your own public address"));
+    strUsage += HelpMessageOpt("-fastblockrelay", strprintf(_("Announce proof-of-stake blocks to peers once their stake and signature are valid, before they are fully connected (default: %u)"), DEFAULT_FAST_BLOCK_RELAY));
     strUsage += HelpMessageOpt("-forcednsseed", strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0));
     strUsage += HelpMessageOpt("-listen", _("Accept connections from outside (default: 1 if no -proxy or -connect)"));
     strUsage += HelpMessageOpt("-maxconnections=<n>", strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125));
@@ -374,6 +379,7 @@ std::string HelpMessage(HelpMessageMode mode)
             FormatMoney(CWallet::minTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in SVG/kB) to add to transactions you send (default: %s)"), FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Set the number of threads reading blocks during a wallet rescan (1 to %d, 0 = auto, default: %d)"), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0));
     strUsage += HelpMessageOpt("-spendzeroconfchange", strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1));
@@ -403,10 +409,14 @@ std::string HelpMessage(HelpMessageMode mode)
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+#ifdef ENABLE_WALLET
+        strUsage += HelpMessageOpt("-checkwalletbalances", strprintf("Compare the running wallet balances with a full scan of the wallet on every balance query (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+#endif
         strUsage += HelpMessageOpt("-checkpoints", strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1));
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0));
         strUsage += HelpMessageOpt("-testsafemode", strprintf(_("Force safe mode (default: %u)"), 0));
+        strUsage += HelpMessageOpt("-capturemessages", strprintf(_("Write every received network message to a per-peer file in <datadir>/captures for replay with replaymessages (default: %u)"), 0));
         strUsage += HelpMessageOpt("-dropmessagestest=<n>", _("Randomly drop 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-fuzzmessagestest=<n>", _("Randomly fuzz 1 of every <n> network messages"));
         strUsage += HelpMessageOpt("-flushwallet", strprintf(_("Run a thread to flush wallet periodically (default: %u)"), 1));
@@ -874,6 +884,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTxConfirmTarget = GetArg("-txconfirmtarget", 1);
     bSpendZeroConfChange = GetArg("-spendzeroconfchange", true);
     fSendFreeTransactions = GetArg("-sendfreetransactions", false);
+    fCheckWalletBalances = GetBoolArg("-checkwalletbalances", Params().DefaultConsistencyChecks());
+    nRescanThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nRescanThreads <= 0)
+        nRescanThreads = boost::thread::hardware_concurrency();
+    nRescanThreads = std::max(1, std::min(nRescanThreads, MAX_RESCAN_THREADS));
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
 #endif // ENABLE_WALLET
@@ -882,6 +897,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
     fAlerts = GetBoolArg("-alerts", DEFAULT_ALERTS);
+    fFastBlockRelay = GetBoolArg("-fastblockrelay", DEFAULT_FAST_BLOCK_RELAY);
+    nMaxOrphanTransactions = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    nMaxOrphanTxSize = std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE));
 
 
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
@@ -932,8 +950,17 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nScriptCheckThreads) {
         for (int i = 0; i < nScriptCheckThreads - 1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        // masternode messages are verified in batches by as many threads, when synced they sit idle
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadSignatureCheck);
     }
 
+    int nBlockServeThreads = std::max(0, std::min((int)GetArg("-blockservethreads", DEFAULT_BLOCK_SERVE_THREADS), MAX_BLOCK_SERVE_THREADS));
+    LogPrintf("Using %u threads for serving blocks\n", nBlockServeThreads);
+    blockServer.SetThreads(nBlockServeThreads);
+    for (int i = 0; i < nBlockServeThreads; i++)
+        threadGroup.create_thread(&ThreadBlockServer);
+
     if (mapArgs.count("-sporkkey")) // spork priv key
     {
         if (!sporkManager.SetPrivKey(GetArg("-sporkkey", "")))
@@ -1125,6 +1152,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     // see Step 2: parameter interactions for more information about these
     fListen = GetBoolArg("-listen", DEFAULT_LISTEN);
     fDiscover = GetBoolArg("-discover", true);
+    fCaptureMessages = GetBoolArg("-capturemessages", false);
     fNameLookup = GetBoolArg("-dns", true);
 
     bool fBound = false;
@@ -1462,8 +1490,25 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     uiInterface.InitMessage(_("Loading masternode cache..."));
 
+    // watch for collateral spends from here on, CheckCollaterals below looks at what happened before
+    RegisterValidationInterface(&mnodeman);
+    sporkManager.NotifySporkChanged.connect(boost::bind(&CMasternodeMan::UpdatedSpork, &mnodeman, _1, _2));
+
+    // the caches do not depend on each other until they are cleaned, so read them in parallel
     CMasternodeDB mndb;
-    CMasternodeDB::ReadResult readResult = mndb.Read(mnodeman);
+    CMasternodeDB::ReadResult readResult;
+    CBudgetDB budgetdb;
+    CBudgetDB::ReadResult readResult2;
+    CMasternodePaymentDB mnpayments;
+    CMasternodePaymentDB::ReadResult readResult3;
+    {
+        boost::thread_group loaders;
+        loaders.create_thread(boost::bind(&CMasternodeDB::Load, &mndb, boost::ref(mnodeman), boost::ref(readResult)));
+        loaders.create_thread(boost::bind(&CBudgetDB::Load, &budgetdb, boost::ref(budget), boost::ref(readResult2)));
+        loaders.create_thread(boost::bind(&CMasternodePaymentDB::Load, &mnpayments, boost::ref(masternodePayments), boost::ref(readResult3)));
+        loaders.join_all();
+    }
+
     if (readResult == CMasternodeDB::FileError)
         LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
     else if (readResult != CMasternodeDB::Ok) {
@@ -1472,12 +1517,21 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    } else {
+        LogPrintf("Masternode manager - cleaning....\n");
+        mnodeman.CheckCollaterals();
+        mnodeman.CheckAndRemove(true);
+        LogPrintf("Masternode manager - result:\n");
+        LogPrintf("  %s\n", mnodeman.ToString());
     }
 
-    uiInterface.InitMessage(_("Loading budget cache..."));
+    uiInterface.InitMessage(_("Loading masternode payments from blocks..."));
 
-    CBudgetDB budgetdb;
-    CBudgetDB::ReadResult readResult2 = budgetdb.Read(budget);
+    {
+        // cover the window GetLastPaid looks at, for the list we know and some growth
+        LOCK(cs_main);
+        masternodePayments.lastPaid.Load(chainActive.Tip(), std::max(mnodeman.size(), 1000) * 5 / 4);
+    }
 
     if (readResult2 == CBudgetDB::FileError)
         LogPrintf("Missing budget cache - budget.dat, will try to recreate\n");
@@ -1487,18 +1541,17 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    } else {
+        LogPrintf("Budget manager - cleaning....\n");
+        budget.CheckAndRemove();
+        LogPrintf("Budget manager - result:\n");
+        LogPrintf("  %s\n", budget.ToString());
     }
 
     //flag our cached items so we send them to our peers
     budget.ResetSync();
     budget.ClearSeen();
 
-
-    uiInterface.InitMessage(_("Loading masternode payment cache..."));
-
-    CMasternodePaymentDB mnpayments;
-    CMasternodePaymentDB::ReadResult readResult3 = mnpayments.Read(masternodePayments);
-
     if (readResult3 == CMasternodePaymentDB::FileError)
         LogPrintf("Missing masternode payment cache - mnpayments.dat, will try to recreate\n");
     else if (readResult3 != CMasternodePaymentDB::Ok) {
@@ -1507,6 +1560,11 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    } else {
+        LogPrintf("Masternode payments manager - cleaning....\n");
+        masternodePayments.CleanPaymentList();
+        LogPrintf("Masternode payments manager - result:\n");
+        LogPrintf("  %s\n", masternodePayments.ToString());
     }
 
     fMasterNode = GetBoolArg("-masternode", false);
@@ -1618,6 +1676,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     DarKsendPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarKsendPool));
+    threadGroup.create_thread(boost::bind(&ThreadInstantXLocks));
 
     // ********************************************************* Step 11: start node
 
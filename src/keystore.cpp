@@ -27,10 +27,18 @@ bool CKeyStore::AddKey(const CKey& key)
     return AddKeyPubKey(key, key.GetPubKey());
 }
 
+void CBasicKeyStore::AddKnownScripts(const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_KeyStore);
+    setKnownScripts.insert(GetScriptForDestination(pubkey.GetID()));
+    setKnownScripts.insert(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+}
+
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey& pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    AddKnownScripts(pubkey);
     return true;
 }
 
@@ -41,6 +49,7 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 
     LOCK(cs_KeyStore);
     mapScripts[CScriptID(redeemScript)] = redeemScript;
+    setKnownScripts.insert(GetScriptForDestination(CScriptID(redeemScript)));
     return true;
 }
 
@@ -65,6 +74,7 @@ bool CBasicKeyStore::AddWatchOnly(const CScript& dest)
 {
     LOCK(cs_KeyStore);
     setWatchOnly.insert(dest);
+    setKnownScripts.insert(dest);
     return true;
 }
 
@@ -86,3 +96,9 @@ bool CBasicKeyStore::HaveWatchOnly() const
     LOCK(cs_KeyStore);
     return (!setWatchOnly.empty());
 }
+
+bool CBasicKeyStore::HaveKnownScript(const CScript& scriptPubKey) const
+{
+    LOCK(cs_KeyStore);
+    return setKnownScripts.count(scriptPubKey) > 0;
+}
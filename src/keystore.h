@@ -8,12 +8,14 @@
 
 #include "key.h"
 #include "pubkey.h"
+#include "script/script.h"
 #include "sync.h"
 
+#include <boost/functional/hash.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/variant.hpp>
 
-class CScript;
 class CScriptID;
 
 /** A virtual base class for key stores */
@@ -45,11 +47,22 @@ public:
     virtual bool RemoveWatchOnly(const CScript& dest) = 0;
     virtual bool HaveWatchOnly(const CScript& dest) const = 0;
     virtual bool HaveWatchOnly() const = 0;
+
+    //! Whether scriptPubKey may pay to this store; if not, IsMine() need not look at it
+    virtual bool HaveKnownScript(const CScript& scriptPubKey) const { return true; }
+};
+
+struct CScriptHasher {
+    size_t operator()(const CScript& script) const
+    {
+        return boost::hash_range(script.begin(), script.end());
+    }
 };
 
 typedef std::map<CKeyID, CKey> KeyMap;
 typedef std::map<CScriptID, CScript> ScriptMap;
 typedef std::set<CScript> WatchOnlySet;
+typedef boost::unordered_set<CScript, CScriptHasher> KnownScriptSet;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
@@ -58,6 +71,12 @@ protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
     WatchOnlySet setWatchOnly;
+    //! P2PKH and P2PK scripts of all keys, P2SH scripts of all redeem scripts and all watch-only
+    //! scripts. Entries are never removed, a stale one only costs IsMine() its full check.
+    KnownScriptSet setKnownScripts;
+
+    //! Remember the scripts paying to pubkey, requires cs_KeyStore
+    void AddKnownScripts(const CPubKey& pubkey);
 
 public:
     bool AddKeyPubKey(const CKey& key, const CPubKey& pubkey);
@@ -102,6 +121,8 @@ public:
     virtual bool RemoveWatchOnly(const CScript& dest);
     virtual bool HaveWatchOnly(const CScript& dest) const;
     virtual bool HaveWatchOnly() const;
+
+    virtual bool HaveKnownScript(const CScript& scriptPubKey) const;
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
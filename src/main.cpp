@@ -11,6 +11,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockserver.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -69,6 +70,7 @@ bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
+bool fFastBlockRelay = DEFAULT_FAST_BLOCK_RELAY;
 
 unsigned int nStakeMinAge = 12 * 60 * 60;  //12hours Mainnet
 unsigned int nStakeMinAgeTestNet = 2 * 60 * 60; //2hours Testnet
@@ -86,9 +88,20 @@ CTxMemPool mempool(::minRelayTxFee);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+struct COrphanPeerUsage {
+    unsigned int nCount;
+    uint64_t nBytes;
+    COrphanPeerUsage() : nCount(0), nBytes(0) {}
+};
+map<NodeId, COrphanPeerUsage> mapOrphanUsageByPeer;
+uint64_t nOrphanBytes = 0;
+unsigned int nMaxOrphanTransactions = DEFAULT_MAX_ORPHAN_TRANSACTIONS;
+uint64_t nMaxOrphanTxSize = DEFAULT_MAX_ORPHAN_TX_SIZE;
 map<uint256, int64_t> mapRejectedBlocks;
 
 
@@ -368,12 +381,14 @@ void FinalizeNode(NodeId nodeid)
     mapNodeState.erase(nodeid);
 }
 
-// Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+// Requires cs_main. If pfrom is the outbound peer the block was requested from, its delivery latency is recorded.
+void MarkBlockAsReceived(const uint256& hash, const CNode* pfrom = NULL)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState* state = State(itInFlight->second.first);
+        if (pfrom && !pfrom->fInbound && itInFlight->second.first == pfrom->GetId())
+            addrman.BlockDelivered(pfrom->addr, GetTimeMicros() - itInFlight->second.second->nTime);
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
@@ -606,21 +621,39 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
+    if (sz > MAX_ORPHAN_TX_SIZE) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // A single peer may only fill its share of the pool, so it cannot push out everyone else's orphans.
+    // The share is taken of the limits that actually bind: the count limit caps the pool at
+    // nMaxOrphanTransactions * MAX_ORPHAN_TX_SIZE bytes long before the default byte limit is reached.
+    uint64_t nEffectiveMaxBytes = std::min(nMaxOrphanTxSize, (uint64_t)nMaxOrphanTransactions * MAX_ORPHAN_TX_SIZE);
+    uint64_t nPeerMaxBytes = nEffectiveMaxBytes * ORPHAN_TX_PEER_QUOTA_PCT / 100;
+    unsigned int nPeerMaxCount = std::max(1u, nMaxOrphanTransactions * ORPHAN_TX_PEER_QUOTA_PCT / 100);
+    COrphanPeerUsage& usage = mapOrphanUsageByPeer[peer];
+    if (usage.nCount + 1 > nPeerMaxCount || usage.nBytes + sz > nPeerMaxBytes) {
+        LogPrint("mempool", "ignoring orphan tx %s, peer=%d is over its quota (%u tx, %u bytes)\n", hash.ToString(), peer, usage.nCount, usage.nBytes);
+        if (usage.nCount == 0)
+            mapOrphanUsageByPeer.erase(peer);
+        return false;
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    usage.nCount++;
+    usage.nBytes += sz;
+    nOrphanBytes += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanBytes);
     return true;
 }
 
@@ -630,18 +663,29 @@ void static EraseOrphanTx(uint256 hash)
     if (it == mapOrphanTransactions.end())
         return;
     BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanUsageByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanUsageByPeer.end()) {
+        itPeer->second.nCount--;
+        itPeer->second.nBytes -= it->second.nTxSize;
+        if (itPeer->second.nCount == 0)
+            mapOrphanUsageByPeer.erase(itPeer);
+    }
+    nOrphanBytes -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
+    if (!mapOrphanUsageByPeer.count(peer))
+        return;
+
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end()) {
@@ -655,10 +699,33 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
+
+    // Sweep out expired orphans, at most once per expiry interval
+    static int64_t nNextSweep = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweeping again before the next orphan expires would be pointless
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d expired orphan tx\n", nErased);
+        nEvicted += nErased;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanBytes > nMaxBytes) {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
         map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
@@ -670,6 +737,69 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+/**
+ * Accept orphans that spend outputs of a newly accepted transaction. Orphans are resolved in rounds:
+ * every orphan spending an output of the transactions accepted in the previous round is tried once,
+ * so a chain of dependent orphans is accepted in a single call. Requires cs_main.
+ */
+void static ProcessOrphansFor(const CTransaction& txParent)
+{
+    vector<CTransaction> vParents(1, txParent);
+    set<NodeId> setMisbehaving;
+
+    while (!vParents.empty()) {
+        // Gather each orphan spending one of the parents' outputs once, in a stable order
+        set<uint256> setCandidates;
+        BOOST_FOREACH (const CTransaction& tx, vParents) {
+            uint256 hashParent = tx.GetHash();
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hashParent, i));
+                if (itByPrev != mapOrphanTransactionsByPrev.end())
+                    setCandidates.insert(itByPrev->second.begin(), itByPrev->second.end());
+            }
+        }
+        // The orphans accepted in this round are the parents of the next one
+        vParents.clear();
+
+        vector<uint256> vEraseQueue;
+        BOOST_FOREACH (const uint256& orphanHash, setCandidates) {
+            const COrphanTx& orphan = mapOrphanTransactions[orphanHash];
+            if (setMisbehaving.count(orphan.fromPeer))
+                continue;
+
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+            if (AcceptToMemoryPool(mempool, stateDummy, orphan.tx, true, &fMissingInputs2)) {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphan.tx);
+                vParents.push_back(orphan.tx);
+                vEraseQueue.push_back(orphanHash);
+            } else if (!fMissingInputs2) {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(orphan.fromPeer, nDos);
+                    setMisbehaving.insert(orphan.fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                vEraseQueue.push_back(orphanHash);
+            }
+        }
+
+        if (!vParents.empty())
+            mempool.check(pcoinsTip);
+
+        BOOST_FOREACH (const uint256& hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -889,9 +1019,12 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if (nResult < 0) nResult = 0;
 
     if (nResult < 6) {
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()) {
-            sigs = (*i).second.CountSignatures();
+        {
+            LOCK(cs_instantx);
+            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
+            if (i != mapTxLocks.end()) {
+                sigs = (*i).second.CountSignatures();
+            }
         }
         if (sigs >= INSTANTX_SIGNATURES_REQUIRED) {
             return nInstantXDepth + nResult;
@@ -905,9 +1038,12 @@ int GetIXConfirmations(uint256 nTXHash)
 {
     int sigs = 0;
 
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()) {
-        sigs = (*i).second.CountSignatures();
+    {
+        LOCK(cs_instantx);
+        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
+        if (i != mapTxLocks.end()) {
+            sigs = (*i).second.CountSignatures();
+        }
     }
     if (sigs >= INSTANTX_SIGNATURES_REQUIRED) {
         return nInstantXDepth;
@@ -1122,12 +1258,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
     // ----------- InstantX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
+    {
+        LOCK(cs_instantx);
+        BOOST_FOREACH (const CTxIn& in, tx.vin) {
+            if (mapLockedInputs.count(in.prevout)) {
+                if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+                    return state.DoS(0,
+                        error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+                        REJECT_INVALID, "tx-lock-conflict");
+                }
             }
         }
     }
@@ -1316,12 +1455,15 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     // ----------- InstantX transaction scanning -----------
 
-    BOOST_FOREACH (const CTxIn& in, tx.vin) {
-        if (mapLockedInputs.count(in.prevout)) {
-            if (mapLockedInputs[in.prevout] != tx.GetHash()) {
-                return state.DoS(0,
-                    error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                    REJECT_INVALID, "tx-lock-conflict");
+    {
+        LOCK(cs_instantx);
+        BOOST_FOREACH (const CTxIn& in, tx.vin) {
+            if (mapLockedInputs.count(in.prevout)) {
+                if (mapLockedInputs[in.prevout] != tx.GetHash()) {
+                    return state.DoS(0,
+                        error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+                        REJECT_INVALID, "tx-lock-conflict");
+                }
             }
         }
     }
@@ -2413,6 +2555,7 @@ bool static DisconnectTip(CValidationState& state)
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    masternodePayments.lastPaid.BlockDisconnected(block, pindexDelete->nHeight);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
@@ -2485,6 +2628,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    masternodePayments.lastPaid.BlockConnected(*pblock, pindexNew->nHeight);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH (const CTransaction& tx, txConflicted) {
@@ -3135,6 +3279,7 @@ REJECT_INVALID, "bad-header", true);
     // ----------- InstantX transaction scanning -----------
 
     if (IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)) {
+        LOCK(cs_instantx);
         BOOST_FOREACH (const CTransaction& tx, block.vtx) {
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
@@ -3478,6 +3623,34 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+/**
+ * Announce a proof-of-stake block that extends our tip as soon as its header, stake kernel and
+ * signature have been validated by AcceptBlock, before the scripts are checked while connecting it.
+ * The inv is pushed straight onto the send queue so it leaves while we are still validating.
+ */
+static void RelayBlockEarly(const CBlockIndex* pindex, const CNode* pfrom)
+{
+    CInv inv(MSG_BLOCK, pindex->GetBlockHash());
+    vector<CInv> vInv(1, inv);
+    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode == pfrom || pnode->fDisconnect)
+            continue;
+        if (pindex->nHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+            continue;
+        {
+            LOCK(pnode->cs_inventory);
+            // the regular relay after ActivateBestChain will skip peers that already know the block
+            if (!pnode->setInventoryKnown.insert(inv).second)
+                continue;
+        }
+        pnode->PushMessage("inv", vInv);
+    }
+    LogPrint("net", "%s : announced block %s at height %d before connecting it\n", __func__, inv.hash.ToString(), pindex->nHeight);
+}
+
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
     // Preliminary checks
@@ -3502,6 +3675,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         }
     }
 
+    CBlockIndex* pindexRelayEarly = NULL;
     while (true) {
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
@@ -3509,13 +3683,14 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
             continue;
         }
 
-        MarkBlockAsReceived(pblock->GetHash());
+        MarkBlockAsReceived(pblock->GetHash(), pfrom);
         if (!checked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
 
         // Store to disk
         CBlockIndex* pindex = NULL;
+        bool fAlreadyHave = mapBlockIndex.count(pblock->GetHash()) && (mapBlockIndex[pblock->GetHash()]->nStatus & BLOCK_HAVE_DATA);
         bool ret = AcceptBlock(*pblock, state, &pindex, dbp);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
@@ -3523,9 +3698,18 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         CheckBlockIndex();
         if (!ret)
             return error("%s : AcceptBlock FAILED", __func__);
+
+        // AcceptBlock has checked the stake kernel (CheckWork) and CheckBlockSignature passed above;
+        // only a block that would become our new tip is announced ahead of full validation.
+        if (fFastBlockRelay && pfrom && !fAlreadyHave && pblock->IsProofOfStake() &&
+            pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload())
+            pindexRelayEarly = pindex;
         break;
     }
 
+    if (pindexRelayEarly)
+        RelayBlockEarly(pindexRelayEarly, pfrom);
+
     if (!ActivateBestChain(state, pblock))
         return error("%s : ActivateBestChain failed", __func__);
 
@@ -4309,11 +4493,15 @@ bool static AlreadyHave(const CInv& inv)
         return mapDarksendBroadcastTxes.count(inv.hash);
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
-    case MSG_TXLOCK_REQUEST:
+    case MSG_TXLOCK_REQUEST: {
+        LOCK(cs_instantx);
         return mapTxLockReq.count(inv.hash) ||
                mapTxLockReqRejected.count(inv.hash);
-    case MSG_TXLOCK_VOTE:
+    }
+    case MSG_TXLOCK_VOTE: {
+        LOCK(cs_instantx);
         return mapTxLockVote.count(inv.hash);
+    }
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -4360,12 +4548,22 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Whether pfrom is a connected node, which the block server may hold a reference to */
+static bool IsInVNodes(CNode* pfrom)
+{
+    LOCK(cs_vNodes);
+    return std::find(vNodes.begin(), vNodes.end(), pfrom) != vNodes.end();
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
+    // Nodes outside vNodes (such as the one replaying captured messages) are served inline
+    bool fBlockServer = blockServer.IsActive() && IsInVNodes(pfrom);
+
     LOCK(cs_main);
 
     while (it != pfrom->vRecvGetData.end()) {
@@ -4374,6 +4572,7 @@ void static ProcessGetData(CNode* pfrom)
             break;
 
         const CInv& inv = *it;
+
         {
             boost::this_thread::interruption_point();
             it++;
@@ -4396,43 +4595,17 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (send) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
-                        }
-                        // else
-                        // no response
-                    }
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
+                    // Announce our tip right after the last block of the batch so they send the next getblocks
+                    uint256 hashContinue = 0;
                     if (inv.hash == pfrom->hashContinue) {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        hashContinue = chainActive.Tip()->GetBlockHash();
                         pfrom->hashContinue = 0;
                     }
+                    // The disk position is all the block server needs, so reading it does not hold cs_main
+                    if (fBlockServer)
+                        blockServer.Push(pfrom, inv, mi->second->GetBlockPos(), hashContinue);
+                    else
+                        PushBlock(pfrom, inv, mi->second->GetBlockPos(), hashContinue);
                 }
             } else if (inv.IsKnownType()) {
                 // Send stream from relay memory
@@ -4457,6 +4630,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
+                    LOCK(cs_instantx);
                     if (mapTxLockVote.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4466,6 +4640,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
+                    LOCK(cs_instantx);
                     if (mapTxLockReq.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4805,8 +4980,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
 
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
+            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK) {
                 pfrom->AskFor(inv);
+                masternodeSync.AddedInventory(inv);
+            }
 
 
             if (inv.type == MSG_BLOCK) {
@@ -4922,8 +5099,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 
     else if (strCommand == "tx" || strCommand == "dstx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -4985,64 +5160,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Process any orphan transactions that depended on this one
+            ProcessOrphansFor(tx);
         } else if (fMissingInputs) {
             AddOrphanTx(tx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTransactions, nMaxOrphanTxSize);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else if (pfrom->fWhitelisted) {
@@ -5249,6 +5379,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (pingUsecTime > 0) {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+                        if (!pfrom->fInbound)
+                            addrman.UpdatePing(pfrom->addr, pingUsecTime);
                     } else {
                         // This should never happen
                         sProblem = "Timing mishap";
@@ -5462,6 +5594,19 @@ int StakeMinAge()
 }
 
 
+static bool IsMasternodeAnnounce(const std::string& strCommand)
+{
+    return strCommand == "mnb" || strCommand == "mnp";
+}
+
+// Messages that are checked against the masternode list, so announces queued for batch verification must be in it first
+static bool IsMasternodeDependent(const std::string& strCommand)
+{
+    return strCommand == "mnw" || strCommand == "mnvs" || strCommand == "mprop" || strCommand == "mvote" ||
+           strCommand == "fbs" || strCommand == "fbvote" || strCommand == "txlvote" || strCommand == "dsq" ||
+           strCommand == "ssc";
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -5478,11 +5623,18 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    // a block sent by the block server is the response to everything before it,
+    // so nothing else is answered for this peer until the server is done with it
+    pfrom->fWaitBlockServer = blockServer.IsActive() && blockServer.IsServing(pfrom->GetId());
+    if (pfrom->fWaitBlockServer) return fOk;
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
+    pfrom->fWaitBlockServer = blockServer.IsActive() && blockServer.IsServing(pfrom->GetId());
+    if (pfrom->fWaitBlockServer) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -5534,6 +5686,13 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        if (fCaptureMessages)
+            pfrom->CaptureMessage(strCommand, vRecv, nMessageSize, msg.nTime);
+
+        // announces queued from any peer may add the masternode this message refers to
+        if (IsMasternodeDependent(strCommand))
+            mnodeman.ProcessPendingAnnounces();
+
         // Process message
         bool fRet = false;
         try {
@@ -5561,6 +5720,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
+        // masternode announces are verified in batches, flush them once this peer's run of them ends
+        if (IsMasternodeAnnounce(strCommand) && (it == pfrom->vRecvMsg.end() || !IsMasternodeAnnounce(it->hdr.GetCommand())))
+            mnodeman.ProcessPendingAnnounces();
+
         break;
     }
 
@@ -5571,6 +5734,93 @@ bool ProcessMessages(CNode* pfrom)
     return fOk;
 }
 
+// Flush the masternode announces queued during replay, timed as pseudo-command "mnverify"
+static void ReplayPendingAnnounces(std::map<std::string, CReplayStats>& mapStats)
+{
+    int64_t nStart = GetTimeMicros();
+    mnodeman.ProcessPendingAnnounces();
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    CReplayStats& stats = mapStats["mnverify"];
+    stats.nCount++;
+    stats.nTotalUsec += nElapsed;
+    stats.nMaxUsec = std::max(stats.nMaxUsec, nElapsed);
+}
+
+// Process the masternode announces and InstantX votes still queued, they reference the replay node
+static void ReplayDrainQueues()
+{
+    mnodeman.ProcessPendingAnnounces();
+    instantXLocks.ProcessPending();
+}
+
+bool ReplayMessages(const boost::filesystem::path& pathCapture, std::map<std::string, CReplayStats>& mapStats, std::string& strError)
+{
+    CAutoFile filein(fopen(pathCapture.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        strError = strprintf("cannot open %s", pathCapture.string());
+        return false;
+    }
+
+    // A node without a socket: replies pile up in vSendMsg and are dropped after every message
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "replay", true);
+    bool fPendingAnnounces = false;
+    while (true) {
+        CCapturedMessage msg;
+        try {
+            filein >> msg;
+        } catch (std::ios_base::failure& e) {
+            if (!feof(filein.Get())) {
+                ReplayDrainQueues();
+                strError = strprintf("error reading %s: %s", pathCapture.string(), e.what());
+                return false;
+            }
+            break;
+        }
+
+        if (fPendingAnnounces && !IsMasternodeAnnounce(msg.strCommand)) {
+            ReplayPendingAnnounces(mapStats);
+            fPendingAnnounces = false;
+        }
+        fPendingAnnounces |= IsMasternodeAnnounce(msg.strCommand);
+
+        CReplayStats& stats = mapStats[msg.strCommand];
+        CDataStream vRecv(msg.vPayload, SER_NETWORK, node.nRecvVersion);
+        bool fRet = false;
+        int64_t nStart = GetTimeMicros();
+        try {
+            fRet = ProcessMessage(&node, msg.strCommand, vRecv, msg.nTime);
+        } catch (boost::thread_interrupted) {
+            ReplayDrainQueues();
+            throw;
+        } catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ReplayMessages()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ReplayMessages()");
+        }
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        stats.nCount++;
+        stats.nFailed += !fRet;
+        stats.nTotalUsec += nElapsed;
+        stats.nMaxUsec = std::max(stats.nMaxUsec, nElapsed);
+
+        {
+            LOCK(node.cs_vSend);
+            node.vSendMsg.clear();
+            node.nSendSize = 0;
+            node.nSendOffset = 0;
+        }
+        node.vRecvGetData.clear();
+    }
+
+    if (fPendingAnnounces)
+        ReplayPendingAnnounces(mapStats);
+    ReplayDrainQueues();
+
+    return true;
+}
+
 
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
@@ -5873,5 +6123,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanUsageByPeer.clear();
+        nOrphanBytes = 0;
     }
 } instance_of_cmaincleanup;
@@ -52,6 +52,7 @@ class CValidationState;
 
 struct CBlockTemplate;
 struct CNodeStateStats;
+struct CReplayStats;
 
 /** Masternode Amount **/
 static const int MASTERNODEAMOUNT = 5000;
@@ -63,6 +64,8 @@ static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
+/** Default for -fastblockrelay, announcing PoS blocks before they are fully connected */
+static const bool DEFAULT_FAST_BLOCK_RELAY = false;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 250000;
 /** The maximum allowed number of signature check operations in a block (network rule) */
@@ -73,6 +76,16 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum total size in bytes of orphan transactions kept in memory */
+static const uint64_t DEFAULT_MAX_ORPHAN_TX_SIZE = 5000000;
+/** Orphan transactions bigger than this many bytes are not kept */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Share (in percent) of the orphan pool, by count and by bytes, a single peer may fill */
+static const unsigned int ORPHAN_TX_PEER_QUOTA_PCT = 25;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -141,6 +154,9 @@ extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
+extern bool fFastBlockRelay;
+extern unsigned int nMaxOrphanTransactions;
+extern uint64_t nMaxOrphanTxSize;
 
 extern bool fLargeWorkForkFound;
 extern bool fLargeWorkInvalidChainFound;
@@ -210,6 +226,8 @@ int ActiveCollateral();
 int StakeMinAge();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Feed a -capturemessages file through ProcessMessage on a detached node, timing each command */
+bool ReplayMessages(const boost::filesystem::path& pathCapture, std::map<std::string, CReplayStats>& mapStats, std::string& strError);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -271,6 +289,16 @@ struct CNodeStateStats {
     std::vector<int> vHeightInFlight;
 };
 
+/** Per-command timings collected by ReplayMessages */
+struct CReplayStats {
+    int nCount;
+    int nFailed;
+    int64_t nTotalUsec;
+    int64_t nMaxUsec;
+
+    CReplayStats() : nCount(0), nFailed(0), nTotalUsec(0), nMaxUsec(0) {}
+};
+
 struct CDiskTxPos : public CDiskBlockPos {
     unsigned int nTxOffset; // after header
 
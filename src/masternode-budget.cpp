@@ -20,6 +20,7 @@
 
 CBudgetManager budget;
 CCriticalSection cs_budget;
+CBudgetVoteSigCache budgetVoteSigCache;
 
 std::map<uint256, int64_t> askedForSourceProposalOrBudget;
 std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
@@ -97,6 +98,68 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
+bool CBudgetVoteSigCache::Verify(const uint256& hashVote, const CPubKey& pubKeyMasternode, const std::vector<unsigned char>& vchSig, const std::string& strMessage)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashVote;
+    ss << pubKeyMasternode;
+    ss << vchSig;
+    uint256 hashKey = ss.GetHash();
+
+    {
+        LOCK(cs);
+        if (setVerified.count(hashKey)) {
+            nHits++;
+            return true;
+        }
+        nChecks++;
+    }
+
+    std::string errorMessage;
+    std::vector<unsigned char> vchSigCheck(vchSig);
+    if (!DarKsendSigner.VerifyMessage(pubKeyMasternode, vchSigCheck, strMessage, errorMessage)) {
+        LOCK(cs);
+        nFailures++;
+        return false;
+    }
+
+    LOCK(cs);
+    if (setVerified.insert(hashKey).second) {
+        vecInsertOrder.push_back(hashKey);
+        while (vecInsertOrder.size() > BUDGET_VOTE_SIGCACHE_SIZE) {
+            setVerified.erase(vecInsertOrder.front());
+            vecInsertOrder.pop_front();
+            nEvictions++;
+        }
+    }
+    return true;
+}
+
+int CBudgetVoteSigCache::size() const
+{
+    LOCK(cs);
+    return (int)setVerified.size();
+}
+
+void CBudgetVoteSigCache::GetStats(int64_t& nChecksRet, int64_t& nHitsRet, int64_t& nFailuresRet, int64_t& nEvictionsRet) const
+{
+    LOCK(cs);
+    nChecksRet = nChecks;
+    nHitsRet = nHits;
+    nFailuresRet = nFailures;
+    nEvictionsRet = nEvictions;
+}
+
+std::string CBudgetVoteSigCache::ToString() const
+{
+    LOCK(cs);
+    std::ostringstream info;
+
+    info << "Verified vote signatures: " << (int)setVerified.size() << ", Checks: " << nChecks << ", Hits: " << nHits << ", Failures: " << nFailures << ", Evictions: " << nEvictions;
+
+    return info.str();
+}
+
 void CBudgetManager::CheckOrphanVotes()
 {
     LOCK(cs);
@@ -231,159 +294,10 @@ void CBudgetManager::SubmitFinalBudget()
     LogPrintf("CBudgetManager::SubmitFinalBudget - Done! %s\n", finalizedBudgetBroadcast.GetHash().ToString());
 }
 
-//
-// CBudgetDB
-//
-
-CBudgetDB::CBudgetDB()
-{
-    pathDB = GetDataDir() / "budget.dat";
-    strMagicMessage = "MasternodeBudget";
-}
-
-bool CBudgetDB::Write(const CBudgetManager& objToSave)
-{
-    LOCK(objToSave.cs);
-
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    fileout.fclose();
-
-    LogPrintf("Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
-
-    return true;
-}
-
-CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
-{
-    LOCK(objToLoad.cs);
-
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrintf("Loaded info from budget.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrintf("  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Budget manager - cleaning....\n");
-        objToLoad.CheckAndRemove();
-        LogPrintf("Budget manager - result:\n");
-        LogPrintf("  %s\n", objToLoad.ToString());
-    }
-
-    return Ok;
-}
-
 void DumpBudgets()
 {
-    int64_t nStart = GetTimeMillis();
-
     CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrintf("Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrintf("Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok) {
-        LogPrintf("Error reading budget.dat: ");
-        if (readResult == CBudgetDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrintf("Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
-
-    LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+    budgetdb.Dump(budget);
 }
 
 bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
@@ -413,6 +327,7 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    fRankingValid = false;
     LogPrintf("CBudgetManager::AddProposal - proposal %s added\n", budgetProposal.GetName ().c_str ());
     return true;
 }
@@ -642,12 +557,13 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
 {
     LOCK(cs);
 
+    // cleans the votes of all proposals if anything changed since the last call
+    GetRankedProposals();
+
     std::vector<CBudgetProposal*> vBudgetProposalRet;
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
-        (*it).second.CleanAndRemove(false);
-
         CBudgetProposal* pbudgetProposal = &((*it).second);
         vBudgetProposalRet.push_back(pbudgetProposal);
 
@@ -669,23 +585,38 @@ struct sortProposalsByVotes {
     }
 };
 
-//Need to review this function
-std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+const std::vector<std::pair<CBudgetProposal*, int> >& CBudgetManager::GetRankedProposals()
 {
-    LOCK(cs);
-
-    // ------- Sort budgets by Yes Count
-
-    std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
+    // vote validity depends on which MNs are listed, not just how many are enabled
+    int nMasternodes = mnodeman.CountEnabled(ActiveProtocol());
+    int nListVersion = mnodeman.GetListVersion();
+    if (fRankingValid && nMasternodes == nRankingMasternodes && nListVersion == nRankingListVersion)
+        return vecRankedProposals;
 
+    vecRankedProposals.clear();
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while (it != mapProposals.end()) {
         (*it).second.CleanAndRemove(false);
-        vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
+        vecRankedProposals.push_back(make_pair(&((*it).second), (*it).second.GetYeas() - (*it).second.GetNays()));
         ++it;
     }
 
-    std::sort(vBudgetPorposalsSort.begin(), vBudgetPorposalsSort.end(), sortProposalsByVotes());
+    std::sort(vecRankedProposals.begin(), vecRankedProposals.end(), sortProposalsByVotes());
+
+    fRankingValid = true;
+    nRankingMasternodes = nMasternodes;
+    nRankingListVersion = nListVersion;
+    return vecRankedProposals;
+}
+
+//Need to review this function
+std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
+{
+    LOCK(cs);
+
+    // ------- Sort budgets by Yes Count
+
+    const std::vector<std::pair<CBudgetProposal*, int> >& vBudgetPorposalsSort = GetRankedProposals();
 
     // ------- Grab The Budgets In Order
 
@@ -700,7 +631,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
 
 
-    std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
+    std::vector<std::pair<CBudgetProposal*, int> >::const_iterator it2 = vBudgetPorposalsSort.begin();
     while (it2 != vBudgetPorposalsSort.end()) {
         CBudgetProposal* pbudgetProposal = (*it2).first;
 
@@ -886,6 +817,7 @@ void CBudgetManager::NewBlock()
         (*it2).second.CleanAndRemove(false);
         ++it2;
     }
+    fRankingValid = false;
 
     LogPrintf("CBudgetManager::NewBlock - mapFinalizedBudgets cleanup - size: %d\n", mapFinalizedBudgets.size());
     std::map<uint256, CFinalizedBudget>::iterator it3 = mapFinalizedBudgets.begin();
@@ -1296,7 +1228,11 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if (!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError))
+        return false;
+
+    fRankingValid = false;
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1333,6 +1269,7 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1345,6 +1282,7 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    RecountVotes();
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1359,6 +1297,7 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    RecountVotes();
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1459,76 +1398,78 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }
 
-    mapVotes[hash] = vote;
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if (it != mapVotes.end()) {
+        CountVote((*it).second, -1);
+        (*it).second = vote;
+    } else {
+        it = mapVotes.insert(make_pair(hash, vote)).first;
+    }
+    CountVote((*it).second, 1);
     return true;
 }
 
-// If masternode voted for a proposal, but is now invalid -- remove the vote
-void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
+void CBudgetProposal::CountVote(const CBudgetVote& vote, int nDelta)
 {
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+    if (vote.nVote == VOTE_YES) nYeasTotal += nDelta;
+    if (vote.nVote == VOTE_NO) nNaysTotal += nDelta;
+
+    if (!vote.fValid) return;
+    if (vote.nVote == VOTE_YES) nYeas += nDelta;
+    if (vote.nVote == VOTE_NO) nNays += nDelta;
+    if (vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
+}
 
+void CBudgetProposal::RecountVotes()
+{
+    nYeas = nNays = nAbstains = 0;
+    nYeasTotal = nNaysTotal = 0;
+
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
     while (it != mapVotes.end()) {
-        (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
+        CountVote((*it).second, 1);
         ++it;
     }
 }
 
-double CBudgetProposal::GetRatio()
+// If masternode voted for a proposal, but is now invalid -- remove the vote
+void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
-    int yeas = 0;
-    int nays = 0;
+    LOCK(cs);
 
     std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
 
     while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES) yeas++;
-        if ((*it).second.nVote == VOTE_NO) nays++;
+        bool fValidVote = (*it).second.SignatureValid(fSignatureCheck);
+        if (fValidVote != (*it).second.fValid) {
+            CountVote((*it).second, -1);
+            (*it).second.fValid = fValidVote;
+            CountVote((*it).second, 1);
+        }
         ++it;
     }
+}
 
-    if (yeas + nays == 0) return 0.0f;
+double CBudgetProposal::GetRatio()
+{
+    if (nYeasTotal + nNaysTotal == 0) return 0.0f;
 
-    return ((double)(yeas) / (double)(yeas + nays));
+    return ((double)(nYeasTotal) / (double)(nYeasTotal + nNaysTotal));
 }
 
 int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nYeas;
 }
 
 int CBudgetProposal::GetNays()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nNays;
 }
 
 int CBudgetProposal::GetAbstains()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while (it != mapVotes.end()) {
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
@@ -1641,7 +1582,6 @@ bool CBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 
 bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 {
-    std::string errorMessage;
     std::string strMessage = vin.prevout.ToStringShort() + nProposalHash.ToString() + boost::lexical_cast<std::string>(nVote) + boost::lexical_cast<std::string>(nTime);
 
     CMasternode* pmn = mnodeman.Find(vin);
@@ -1653,7 +1593,7 @@ bool CBudgetVote::SignatureValid(bool fSignatureCheck)
 
     if (!fSignatureCheck) return true;
 
-    if (!DarKsendSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+    if (!budgetVoteSigCache.Verify(GetHash(), pmn->pubKeyMasternode, vchSig, strMessage)) {
         LogPrintf("CBudgetVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -2069,8 +2009,6 @@ bool CFinalizedBudgetVote::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
 
 bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 {
-    std::string errorMessage;
-
     std::string strMessage = vin.prevout.ToStringShort() + nBudgetHash.ToString() + boost::lexical_cast<std::string>(nTime);
 
     CMasternode* pmn = mnodeman.Find(vin);
@@ -2082,7 +2020,7 @@ bool CFinalizedBudgetVote::SignatureValid(bool fSignatureCheck)
 
     if (!fSignatureCheck) return true;
 
-    if (!DarKsendSigner.VerifyMessage(pmn->pubKeyMasternode, vchSig, strMessage, errorMessage)) {
+    if (!budgetVoteSigCache.Verify(GetHash(), pmn->pubKeyMasternode, vchSig, strMessage)) {
         LogPrintf("CFinalizedBudgetVote::SignatureValid() - Verify message failed\n");
         return false;
     }
@@ -2094,7 +2032,7 @@ std::string CBudgetManager::ToString() const
 {
     std::ostringstream info;
 
-    info << "Proposals: " << (int)mapProposals.size() << ", Budgets: " << (int)mapFinalizedBudgets.size() << ", Seen Budgets: " << (int)mapSeenMasternodeBudgetProposals.size() << ", Seen Budget Votes: " << (int)mapSeenMasternodeBudgetVotes.size() << ", Seen Final Budgets: " << (int)mapSeenFinalizedBudgets.size() << ", Seen Final Budget Votes: " << (int)mapSeenFinalizedBudgetVotes.size();
+    info << "Proposals: " << (int)mapProposals.size() << ", Budgets: " << (int)mapFinalizedBudgets.size() << ", Seen Budgets: " << (int)mapSeenMasternodeBudgetProposals.size() << ", Seen Budget Votes: " << (int)mapSeenMasternodeBudgetVotes.size() << ", Seen Final Budgets: " << (int)mapSeenFinalizedBudgets.size() << ", Seen Final Budget Votes: " << (int)mapSeenFinalizedBudgetVotes.size() << ", " << budgetVoteSigCache.ToString();
 
     return info.str();
 }
@@ -9,6 +9,7 @@
 #define MASTERNODE_BUDGET_H
 
 #include "base58.h"
+#include "flat-database.h"
 #include "init.h"
 #include "key.h"
 #include "main.h"
@@ -16,6 +17,8 @@
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include <deque>
+#include <set>
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -39,6 +42,9 @@ static const CAmount BUDGET_FEE_TX = (50 * COIN);
 static const int64_t BUDGET_FEE_CONFIRMATIONS = 6;
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60 * 60;
 
+// Maximum number of verified vote signatures remembered (~100 bytes each)
+#define BUDGET_VOTE_SIGCACHE_SIZE 100000
+
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
@@ -49,6 +55,40 @@ void DumpBudgets();
 // Define amount of blocks in budget payment cycle
 int GetBudgetPaymentCycleBlocks();
 
+//
+// CBudgetVoteSigCache - Remember which budget and finalized budget vote signatures were verified
+//
+// Votes come back from other peers after ResetSync/ClearSeen, from vote RPCs and from
+// CleanAndRemove(true); a vote already verified against the same masternode key is not
+// verified again. Entries are keyed by vote hash, masternode pubkey and signature, and
+// the oldest are forgotten after BUDGET_VOTE_SIGCACHE_SIZE entries.
+//
+
+class CBudgetVoteSigCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::set<uint256> setVerified;
+    std::deque<uint256> vecInsertOrder;
+
+    int64_t nChecks;    // signatures actually verified
+    int64_t nHits;      // verifications avoided
+    int64_t nFailures;  // signatures that did not verify
+    int64_t nEvictions; // entries dropped to bound the size
+
+public:
+    CBudgetVoteSigCache() : nChecks(0), nHits(0), nFailures(0), nEvictions(0) {}
+
+    /// Verify strMessage was signed by pubKeyMasternode, unless this vote was verified before
+    bool Verify(const uint256& hashVote, const CPubKey& pubKeyMasternode, const std::vector<unsigned char>& vchSig, const std::string& strMessage);
+
+    int size() const;
+    void GetStats(int64_t& nChecksRet, int64_t& nHitsRet, int64_t& nFailuresRet, int64_t& nEvictionsRet) const;
+    std::string ToString() const;
+};
+
+extern CBudgetVoteSigCache budgetVoteSigCache;
+
 //Check the collateral transaction for the budget proposal/finalized budget
 bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, std::string& strError, int64_t& nTime, int& nConf);
 
@@ -149,26 +189,10 @@ public:
 
 /** Save Budget Manager (budget.dat)
  */
-class CBudgetDB
+class CBudgetDB : public CFlatDB<CBudgetManager>
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CBudgetDB();
-    bool Write(const CBudgetManager& objToSave);
-    ReadResult Read(CBudgetManager& objToLoad, bool fDryRun = false);
+    CBudgetDB() : CFlatDB<CBudgetManager>("budget.dat", "MasternodeBudget") {}
 };
 
 
@@ -182,6 +206,15 @@ private:
     // XX42    map<uint256, CTransaction> mapCollateral;
     map<uint256, uint256> mapCollateralTxids;
 
+    // proposals with their yeas minus nays, best first, see GetRankedProposals
+    std::vector<std::pair<CBudgetProposal*, int> > vecRankedProposals;
+    bool fRankingValid;
+    int nRankingMasternodes;
+    int nRankingListVersion;
+
+    /// Proposals sorted by votes, only cleaned and re-sorted after votes or the masternode list changed. Requires cs.
+    const std::vector<std::pair<CBudgetProposal*, int> >& GetRankedProposals();
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -201,6 +234,9 @@ public:
     {
         mapProposals.clear();
         mapFinalizedBudgets.clear();
+        fRankingValid = false;
+        nRankingMasternodes = 0;
+        nRankingListVersion = 0;
     }
 
     void ClearSeen()
@@ -257,6 +293,8 @@ public:
         mapSeenFinalizedBudgetVotes.clear();
         mapOrphanMasternodeBudgetVotes.clear();
         mapOrphanFinalizedBudgetVotes.clear();
+        vecRankedProposals.clear();
+        fRankingValid = false;
     }
     void CheckAndRemove();
     std::string ToString() const;
@@ -267,6 +305,7 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
+        LOCK(cs);
         READWRITE(mapSeenMasternodeBudgetProposals);
         READWRITE(mapSeenMasternodeBudgetVotes);
         READWRITE(mapSeenFinalizedBudgets);
@@ -276,6 +315,10 @@ public:
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
+        if (ser_action.ForRead()) {
+            vecRankedProposals.clear();
+            fRankingValid = false;
+        }
     }
 };
 
@@ -462,6 +505,18 @@ private:
     mutable CCriticalSection cs;
     CAmount nAlloted;
 
+protected:
+    // tallies of mapVotes, kept up to date by AddOrUpdateVote and CleanAndRemove
+    int nYeas;
+    int nNays;
+    int nAbstains;
+    // yes and no votes including invalid ones, for GetRatio
+    int nYeasTotal;
+    int nNaysTotal;
+
+    void CountVote(const CBudgetVote& vote, int nDelta);
+    void RecountVotes();
+
 public:
     bool fValid;
     std::string strProposalName;
@@ -553,6 +608,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if (ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -581,6 +638,11 @@ public:
         swap(first.nTime, second.nTime);
         swap(first.nFeeTXHash, second.nFeeTXHash);
         first.mapVotes.swap(second.mapVotes);
+        swap(first.nYeas, second.nYeas);
+        swap(first.nNays, second.nNays);
+        swap(first.nAbstains, second.nAbstains);
+        swap(first.nYeasTotal, second.nYeasTotal);
+        swap(first.nNaysTotal, second.nNaysTotal);
     }
 
     CBudgetProposalBroadcast& operator=(CBudgetProposalBroadcast from)
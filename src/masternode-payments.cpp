@@ -26,153 +26,109 @@ CCriticalSection cs_mapMasternodeBlocks;
 CCriticalSection cs_mapMasternodePayeeVotes;
 
 //
-// CMasternodePaymentDB
+// CMasternodeLastPaid
 //
 
-CMasternodePaymentDB::CMasternodePaymentDB()
+bool CMasternodeLastPaid::GetPayee(const CBlock& block, CScript& payee)
 {
-    pathDB = GetDataDir() / "mnpayments.dat";
-    strMagicMessage = "MasternodePayments";
+    // FillBlockPayee appends the masternode output to the coinstake, or puts it at vout[1] of the coinbase
+    if (block.IsProofOfStake()) {
+        const CTransaction& txCoinStake = block.vtx[1];
+        if (txCoinStake.vout.size() < 3) return false;
+        payee = txCoinStake.vout.back().scriptPubKey;
+        // a split stake without masternode payment
+        if (payee == txCoinStake.vout[1].scriptPubKey) return false;
+    } else {
+        if (block.vtx.empty() || block.vtx[0].vout.size() < 2) return false;
+        payee = block.vtx[0].vout[1].scriptPubKey;
+    }
+    return true;
 }
 
-bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
+void CMasternodeLastPaid::BlockConnected(const CBlock& block, int nHeight)
 {
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
-    ssObj << strMagicMessage;                   // masternode cache file specific magic message
-    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssObj << objToSave;
-    uint256 hash = Hash(ssObj.begin(), ssObj.end());
-    ssObj << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssObj;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    CScript payee;
+    if (!GetPayee(block, payee)) return;
+
+    LOCK(cs);
+    std::vector<int>& vHeights = mapPaidHeights[payee];
+    if (!vHeights.empty() && vHeights.back() >= nHeight) return;
+    vHeights.push_back(nHeight);
+    if (vHeights.size() > MNPAYMENTS_LASTPAID_HISTORY)
+        vHeights.erase(vHeights.begin());
+
+    // forget payees that have not been paid for a long time
+    if (nHeight % 1000 == 0) {
+        std::map<CScript, std::vector<int> >::iterator it = mapPaidHeights.begin();
+        while (it != mapPaidHeights.end()) {
+            if (it->second.back() < nHeight - MNPAYMENTS_LASTPAID_DEPTH)
+                mapPaidHeights.erase(it++);
+            else
+                ++it;
+        }
     }
-    fileout.fclose();
-
-    LogPrintf("Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
+}
 
-    return true;
+void CMasternodeLastPaid::BlockDisconnected(const CBlock& block, int nHeight)
+{
+    CScript payee;
+    if (!GetPayee(block, payee)) return;
+
+    LOCK(cs);
+    std::map<CScript, std::vector<int> >::iterator it = mapPaidHeights.find(payee);
+    if (it == mapPaidHeights.end()) return;
+    std::vector<int>& vHeights = it->second;
+    while (!vHeights.empty() && vHeights.back() >= nHeight)
+        vHeights.pop_back();
+    if (vHeights.empty())
+        mapPaidHeights.erase(it);
 }
 
-CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments& objToLoad, bool fDryRun)
+void CMasternodeLastPaid::Load(const CBlockIndex* pindexTip, int nDepth)
 {
     int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathDB.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathDB.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathDB);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-        ssObj >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode payement cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
 
+    std::vector<const CBlockIndex*> vIndex;
+    for (const CBlockIndex* pindex = pindexTip; pindex && pindex->nHeight > 0 && (int)vIndex.size() < nDepth; pindex = pindex->pprev)
+        vIndex.push_back(pindex);
 
-        // de-serialize file header (network specific magic number) and ..
-        ssObj >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
+    Clear();
+    BOOST_REVERSE_FOREACH (const CBlockIndex* pindex, vIndex) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex)) {
+            LogPrintf("CMasternodeLastPaid::Load - failed to read block %s\n", pindex->GetBlockHash().ToString());
+            continue;
         }
-
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
-    } catch (std::exception& e) {
-        objToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
+        BlockConnected(block, pindex->nHeight);
     }
 
-    LogPrintf("Loaded info from mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrintf("  %s\n", objToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Masternode payments manager - cleaning....\n");
-        objToLoad.CleanPaymentList();
-        LogPrintf("Masternode payments manager - result:\n");
-        LogPrintf("  %s\n", objToLoad.ToString());
-    }
+    LogPrintf("Loaded masternode payments of the last %d blocks, %d payees  %dms\n", vIndex.size(), size(), GetTimeMillis() - nStart);
+}
 
-    return Ok;
+int CMasternodeLastPaid::GetLastPaidHeight(const CScript& payee) const
+{
+    LOCK(cs);
+    std::map<CScript, std::vector<int> >::const_iterator it = mapPaidHeights.find(payee);
+    if (it == mapPaidHeights.end()) return 0;
+    return it->second.back();
 }
 
-void DumpMasternodePayments()
+int CMasternodeLastPaid::size() const
 {
-    int64_t nStart = GetTimeMillis();
+    LOCK(cs);
+    return mapPaidHeights.size();
+}
 
-    CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrintf("Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok) {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if (readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrintf("Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+void CMasternodeLastPaid::Clear()
+{
+    LOCK(cs);
+    mapPaidHeights.clear();
+}
 
-    LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
+void DumpMasternodePayments()
+{
+    CMasternodePaymentDB paymentdb;
+    paymentdb.Dump(masternodePayments);
 }
 
 bool IsBlockValueValid(const CBlock& block, int64_t nExpectedValue, CAmount nMinted)
@@ -454,8 +410,11 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
 
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
-    if (mapMasternodeBlocks.count(nBlockHeight)) {
-        return mapMasternodeBlocks[nBlockHeight].GetPayee(payee);
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it != mapMasternodeBlocks.end()) {
+        return it->second.GetPayee(payee);
     }
 
     return false;
@@ -478,13 +437,12 @@ bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
     mnpayee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
 
     CScript payee;
-    for (int64_t h = nHeight; h <= nHeight + 8; h++) {
-        if (h == nNotBlockHeight) continue;
-        if (mapMasternodeBlocks.count(h)) {
-            if (mapMasternodeBlocks[h].GetPayee(payee)) {
-                if (mnpayee == payee) {
-                    return true;
-                }
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.lower_bound(nHeight);
+    for (; it != mapMasternodeBlocks.end() && it->first <= nHeight + 8; ++it) {
+        if (it->first == nNotBlockHeight) continue;
+        if (it->second.GetPayee(payee)) {
+            if (mnpayee == payee) {
+                return true;
             }
         }
     }
@@ -507,18 +465,31 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
         }
 
         mapMasternodePayeeVotes[winnerIn.GetHash()] = winnerIn;
+        mapVotesByHeight[winnerIn.nBlockHeight].push_back(winnerIn.GetHash());
 
-        if (!mapMasternodeBlocks.count(winnerIn.nBlockHeight)) {
+        std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(winnerIn.nBlockHeight);
+        if (it == mapMasternodeBlocks.end()) {
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
-            mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
+            it = mapMasternodeBlocks.insert(std::make_pair(winnerIn.nBlockHeight, blockPayees)).first;
         }
+        it->second.AddPayee(winnerIn.payee, 1);
     }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
-
     return true;
 }
 
+void CMasternodePayments::RebuildVoteIndex()
+{
+    LOCK(cs_mapMasternodePayeeVotes);
+
+    mapVotesByHeight.clear();
+    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
+    while (it != mapMasternodePayeeVotes.end()) {
+        mapVotesByHeight[(*it).second.nBlockHeight].push_back((*it).first);
+        ++it;
+    }
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -637,19 +608,18 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size() * 1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-
-        if (nHeight - winner.nBlockHeight > nLimit) {
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+    // drop whole height buckets below the limit
+    int nFirstBlock = nHeight - nLimit;
+    std::map<int, std::vector<uint256> >::iterator it = mapVotesByHeight.begin();
+    while (it != mapVotesByHeight.end() && it->first < nFirstBlock) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing %d old Masternode payments - block %d\n", it->second.size(), it->first);
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+        mapVotesByHeight.erase(it++);
     }
+    mapMasternodeBlocks.erase(mapMasternodeBlocks.begin(), mapMasternodeBlocks.lower_bound(nFirstBlock));
 }
 
 bool CMasternodePaymentWinner::IsValid(CNode* pnode, std::string& strError)
@@ -798,14 +768,12 @@ void CMasternodePayments::Sync(CNode* node, int nCountNeeded)
     if (nCountNeeded > nCount) nCountNeeded = nCount;
 
     int nInvCount = 0;
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while (it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
-        if (winner.nBlockHeight >= nHeight - nCountNeeded && winner.nBlockHeight <= nHeight + 20) {
-            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+    std::map<int, std::vector<uint256> >::iterator it = mapVotesByHeight.lower_bound(nHeight - nCountNeeded);
+    for (; it != mapVotesByHeight.end() && it->first <= nHeight + 20; ++it) {
+        BOOST_FOREACH (const uint256& hash, it->second) {
+            node->PushInventory(CInv(MSG_MASTERNODE_WINNER, hash));
             nInvCount++;
         }
-        ++it;
     }
     node->PushMessage("ssc", MASTERNODE_SYNC_MNW, nInvCount);
 }
@@ -824,17 +792,10 @@ int CMasternodePayments::GetOldestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nOldestBlock = std::numeric_limits<int>::max();
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first < nOldestBlock) {
-            nOldestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return std::numeric_limits<int>::max();
 
-    return nOldestBlock;
+    return mapMasternodeBlocks.begin()->first;
 }
 
 
@@ -842,15 +803,8 @@ int CMasternodePayments::GetNewestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nNewestBlock = 0;
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while (it != mapMasternodeBlocks.end()) {
-        if ((*it).first > nNewestBlock) {
-            nNewestBlock = (*it).first;
-        }
-        it++;
-    }
+    if (mapMasternodeBlocks.empty())
+        return 0;
 
-    return nNewestBlock;
+    return mapMasternodeBlocks.rbegin()->first;
 }
@@ -6,6 +6,7 @@
 #ifndef MASTERNODE_PAYMENTS_H
 #define MASTERNODE_PAYMENTS_H
 
+#include "flat-database.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
@@ -25,6 +26,10 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// payment heights remembered per payee, to survive reorgs
+#define MNPAYMENTS_LASTPAID_HISTORY 8
+// payees not paid for this many blocks are forgotten
+#define MNPAYMENTS_LASTPAID_DEPTH 20000
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -36,26 +41,10 @@ void DumpMasternodePayments();
 
 /** Save Masternode Payment Data (mnpayments.dat)
  */
-class CMasternodePaymentDB
+class CMasternodePaymentDB : public CFlatDB<CMasternodePayments>
 {
-private:
-    boost::filesystem::path pathDB;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
-
-    CMasternodePaymentDB();
-    bool Write(const CMasternodePayments& objToSave);
-    ReadResult Read(CMasternodePayments& objToLoad, bool fDryRun = false);
+    CMasternodePaymentDB() : CFlatDB<CMasternodePayments>("mnpayments.dat", "MasternodePayments") {}
 };
 
 class CMasternodePayee
@@ -230,16 +219,48 @@ public:
 // Keeps track of who should get paid for which blocks
 //
 
+/** Heights at which payee scripts received the masternode output of a block in the active chain
+ */
+class CMasternodeLastPaid
+{
+private:
+    mutable CCriticalSection cs;
+    // most recent height last, at most MNPAYMENTS_LASTPAID_HISTORY per payee
+    std::map<CScript, std::vector<int> > mapPaidHeights;
+
+public:
+    /// Script of the masternode payment output of a block, if it has one
+    static bool GetPayee(const CBlock& block, CScript& payee);
+
+    void BlockConnected(const CBlock& block, int nHeight);
+    void BlockDisconnected(const CBlock& block, int nHeight);
+
+    /// Rebuild from the last nDepth blocks ending at pindexTip
+    void Load(const CBlockIndex* pindexTip, int nDepth);
+
+    /// Height of the last known payment to payee, 0 if there is none
+    int GetLastPaidHeight(const CScript& payee) const;
+
+    int size() const;
+    void Clear();
+};
+
 class CMasternodePayments
 {
 private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // hashes of the votes in mapMasternodePayeeVotes, bucketed by block height
+    std::map<int, std::vector<uint256> > mapVotesByHeight;
+
+    void RebuildVoteIndex();
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    CMasternodeLastPaid lastPaid; // not stored, rebuilt from the chain at startup
 
     CMasternodePayments()
     {
@@ -252,6 +273,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapVotesByHeight.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -293,8 +315,11 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
+        LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead())
+            RebuildVoteIndex();
     }
 };
 
@@ -64,6 +64,16 @@ bool CMasternodeSync::IsBlockchainSynced()
 
 void CMasternodeSync::Reset()
 {
+    {
+        LOCK(cs);
+        mapPendingItems.clear();
+        lastInventory = 0;
+        for (int i = 0; i <= MASTERNODE_SYNC_BUDGET; i++) {
+            nAssetTimeStarted[i] = 0;
+            nAssetTimeFinished[i] = 0;
+        }
+    }
+
     lastSporks = 0;
     lastMasternodeList = 0;
     lastMasternodeWinner = 0;
@@ -90,6 +100,7 @@ void CMasternodeSync::Reset()
 
 void CMasternodeSync::AddedMasternodeList(uint256 hash)
 {
+    ReceivedItem(hash);
     if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
         if (mapSeenSyncMNB[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeList = GetTime();
@@ -103,6 +114,7 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
 
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
+    ReceivedItem(hash);
     if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
         if (mapSeenSyncMNW[hash] < MASTERNODE_SYNC_THRESHOLD) {
             lastMasternodeWinner = GetTime();
@@ -116,6 +128,7 @@ void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 
 void CMasternodeSync::AddedBudgetItem(uint256 hash)
 {
+    ReceivedItem(hash);
     if (budget.mapSeenMasternodeBudgetProposals.count(hash) || budget.mapSeenMasternodeBudgetVotes.count(hash) ||
         budget.mapSeenFinalizedBudgets.count(hash) || budget.mapSeenFinalizedBudgetVotes.count(hash)) {
         if (mapSeenSyncBudget[hash] < MASTERNODE_SYNC_THRESHOLD) {
@@ -128,6 +141,88 @@ void CMasternodeSync::AddedBudgetItem(uint256 hash)
     }
 }
 
+void CMasternodeSync::AddedInventory(const CInv& inv)
+{
+    bool fAsset = false;
+    switch (RequestedMasternodeAssets) {
+    case (MASTERNODE_SYNC_LIST):
+        fAsset = inv.type == MSG_MASTERNODE_ANNOUNCE;
+        break;
+    case (MASTERNODE_SYNC_MNW):
+        fAsset = inv.type == MSG_MASTERNODE_WINNER;
+        break;
+    case (MASTERNODE_SYNC_BUDGET):
+        fAsset = inv.type == MSG_BUDGET_PROPOSAL || inv.type == MSG_BUDGET_VOTE ||
+                 inv.type == MSG_BUDGET_FINALIZED || inv.type == MSG_BUDGET_FINALIZED_VOTE;
+        break;
+    }
+    if (!fAsset) return;
+
+    // several peers announce the same items, each is waited for once
+    LOCK(cs);
+    mapPendingItems.insert(make_pair(inv.hash, GetTime()));
+    lastInventory = GetTime();
+}
+
+void CMasternodeSync::ReceivedItem(const uint256& hash)
+{
+    LOCK(cs);
+    mapPendingItems.erase(hash);
+}
+
+int CMasternodeSync::CountPendingItems()
+{
+    LOCK(cs);
+
+    // items that did not arrive in time were refused or are invalid, stop waiting for them
+    std::map<uint256, int64_t>::iterator it = mapPendingItems.begin();
+    while (it != mapPendingItems.end()) {
+        if ((*it).second < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2)
+            mapPendingItems.erase(it++);
+        else
+            ++it;
+    }
+    return mapPendingItems.size();
+}
+
+int64_t CMasternodeSync::GetLastItemTime()
+{
+    int64_t nLast = 0;
+    switch (RequestedMasternodeAssets) {
+    case (MASTERNODE_SYNC_SPORKS):
+        nLast = lastSporks;
+        break;
+    case (MASTERNODE_SYNC_LIST):
+        nLast = lastMasternodeList;
+        break;
+    case (MASTERNODE_SYNC_MNW):
+        nLast = lastMasternodeWinner;
+        break;
+    case (MASTERNODE_SYNC_BUDGET):
+        nLast = lastBudgetItem;
+        break;
+    }
+
+    LOCK(cs);
+    return std::max(nLast, lastInventory);
+}
+
+int CMasternodeSync::GetReportedCount()
+{
+    switch (RequestedMasternodeAssets) {
+    case (MASTERNODE_SYNC_SPORKS):
+        return countSporks;
+    case (MASTERNODE_SYNC_LIST):
+        return countMasternodeList;
+    case (MASTERNODE_SYNC_MNW):
+        return countMasternodeWinner;
+    case (MASTERNODE_SYNC_BUDGET):
+        // finalized budgets are reported last
+        return countBudgetItemFin;
+    }
+    return 0;
+}
+
 bool CMasternodeSync::IsBudgetPropEmpty()
 {
     return sumBudgetItemProp == 0 && countBudgetItemProp > 0;
@@ -140,6 +235,14 @@ bool CMasternodeSync::IsBudgetFinEmpty()
 
 void CMasternodeSync::GetNextAsset()
 {
+    {
+        LOCK(cs);
+        if (RequestedMasternodeAssets >= MASTERNODE_SYNC_SPORKS && RequestedMasternodeAssets <= MASTERNODE_SYNC_BUDGET)
+            nAssetTimeFinished[RequestedMasternodeAssets] = GetTimeMillis();
+        mapPendingItems.clear();
+        lastInventory = 0;
+    }
+
     switch (RequestedMasternodeAssets) {
     case (MASTERNODE_SYNC_INITIAL):
     case (MASTERNODE_SYNC_FAILED): // should never be used here actually, use Reset() instead
@@ -166,6 +269,25 @@ void CMasternodeSync::GetNextAsset()
     }
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
+
+    LOCK(cs);
+    if (RequestedMasternodeAssets >= MASTERNODE_SYNC_SPORKS && RequestedMasternodeAssets <= MASTERNODE_SYNC_BUDGET) {
+        nAssetTimeStarted[RequestedMasternodeAssets] = GetTimeMillis();
+        nAssetTimeFinished[RequestedMasternodeAssets] = 0;
+    }
+}
+
+void CMasternodeSync::AssetFailed()
+{
+    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
+        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
+        RequestedMasternodeAttempt = 0;
+        lastFailure = GetTime();
+        nCountFailures++;
+    } else {
+        GetNextAsset();
+    }
 }
 
 std::string CMasternodeSync::GetSyncStatus()
@@ -189,6 +311,20 @@ std::string CMasternodeSync::GetSyncStatus()
     return "";
 }
 
+void CMasternodeSync::GetAssetTimings(std::vector<std::pair<std::string, std::pair<int64_t, int> > >& vTimings, int& nPending)
+{
+    static const char* const pszAssets[] = {"", "sporks", "list", "winners", "budget"};
+    int nItems[] = {0, sumSporks, (int)mapSeenSyncMNB.size(), (int)mapSeenSyncMNW.size(), (int)mapSeenSyncBudget.size()};
+
+    LOCK(cs);
+    for (int i = MASTERNODE_SYNC_SPORKS; i <= MASTERNODE_SYNC_BUDGET; i++) {
+        if (nAssetTimeStarted[i] == 0) continue;
+        int64_t nEnd = nAssetTimeFinished[i] ? nAssetTimeFinished[i] : GetTimeMillis();
+        vTimings.push_back(make_pair(std::string(pszAssets[i]), make_pair(nEnd - nAssetTimeStarted[i], nItems[i])));
+    }
+    nPending = mapPendingItems.size();
+}
+
 void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (strCommand == "ssc") { //Sync status count
@@ -245,11 +381,57 @@ void CMasternodeSync::ClearFulfilledRequest()
     }
 }
 
+bool CMasternodeSync::RequestAsset(CNode* pnode)
+{
+    switch (RequestedMasternodeAssets) {
+    case (MASTERNODE_SYNC_SPORKS):
+        if (pnode->HasFulfilledRequest("getsporks")) return false;
+        pnode->FulfilledRequest("getsporks");
+
+        pnode->PushMessage("getsporks"); //get current network sporks
+        return true;
+
+    case (MASTERNODE_SYNC_LIST):
+        if (pnode->nVersion < masternodePayments.GetMinMasternodePaymentsProto()) return false;
+        if (pnode->HasFulfilledRequest("mnsync")) return false;
+        pnode->FulfilledRequest("mnsync");
+
+        mnodeman.DsegUpdate(pnode);
+        return true;
+
+    case (MASTERNODE_SYNC_MNW): {
+        if (pnode->nVersion < masternodePayments.GetMinMasternodePaymentsProto()) return false;
+        if (chainActive.Tip() == NULL) return false;
+        if (pnode->HasFulfilledRequest("mnwsync")) return false;
+        pnode->FulfilledRequest("mnwsync");
+
+        int nMnCount = mnodeman.CountEnabled();
+        pnode->PushMessage("mnget", nMnCount); //sync payees
+        return true;
+    }
+
+    case (MASTERNODE_SYNC_BUDGET): {
+        if (pnode->nVersion < ActiveProtocol()) return false;
+        if (pnode->HasFulfilledRequest("busync")) return false;
+        pnode->FulfilledRequest("busync");
+
+        uint256 n = 0;
+        pnode->PushMessage("mnvs", n); //sync masternode votes
+        return true;
+    }
+    }
+    return false;
+}
+
 void CMasternodeSync::Process()
 {
     static int tick = 0;
 
-    if (tick++ % MASTERNODE_SYNC_TIMEOUT != 0) return;
+    tick++;
+
+    // regtest steps through the assets with one peer every MASTERNODE_SYNC_TIMEOUT seconds
+    bool fRegTest = Params().NetworkID() == CBaseChainParams::REGTEST;
+    if (fRegTest && tick % MASTERNODE_SYNC_TIMEOUT != 1) return;
 
     if (IsSynced()) {
         /* 
@@ -273,14 +455,13 @@ void CMasternodeSync::Process()
     if (RequestedMasternodeAssets == MASTERNODE_SYNC_INITIAL) GetNextAsset();
 
     // sporks synced but blockchain is not, wait until we're almost at a recent block to continue
-    if (Params().NetworkID() != CBaseChainParams::REGTEST &&
-        !IsBlockchainSynced() && RequestedMasternodeAssets > MASTERNODE_SYNC_SPORKS) return;
+    if (!fRegTest && !IsBlockchainSynced() && RequestedMasternodeAssets > MASTERNODE_SYNC_SPORKS) return;
 
     TRY_LOCK(cs_vNodes, lockRecv);
     if (!lockRecv) return;
 
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+    if (fRegTest) {
+        BOOST_FOREACH (CNode* pnode, vNodes) {
             if (RequestedMasternodeAttempt <= 2) {
                 pnode->PushMessage("getsporks"); //get current network sporks
             } else if (RequestedMasternodeAttempt < 4) {
@@ -296,141 +477,58 @@ void CMasternodeSync::Process()
             RequestedMasternodeAttempt++;
             return;
         }
+        return;
+    }
 
-        //set to synced
-        if (RequestedMasternodeAssets == MASTERNODE_SYNC_SPORKS) {
-            if (fDebug) LogPrintf("CMasternodeSync::Process() - lastSporks %lld (GetTime() - MASTERNODE_SYNC_TIMEOUT) %lld\n", lastSporks, GetTime() - MASTERNODE_SYNC_TIMEOUT * 6);
-            if (lastSporks > 0 && lastSporks + MASTERNODE_SYNC_TIMEOUT * 6 > GetTime() && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                GetNextAsset();
-                return;
-            }
+    int nReported = GetReportedCount();
+    int64_t nLastItem = GetLastItemTime();
+    int64_t nQuiet = GetTime() - std::max(nLastItem, nAssetSyncStarted);
 
-            if (lastSporks == 0 &&
-                (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                // maybe there is no sporks at all, so just finish syncing
-                GetNextAsset();
-                return;
-            }
+    if (RequestedMasternodeAttempt > 0) {
+        bool fComplete = false;
+        if (nReported >= std::min(RequestedMasternodeAttempt, MASTERNODE_SYNC_THRESHOLD) && nQuiet >= MASTERNODE_SYNC_QUIET) {
+            // enough peers told us what they have and everything announced has arrived
+            fComplete = CountPendingItems() == 0;
+        }
+        if (!fComplete && nLastItem > 0 && nQuiet > MASTERNODE_SYNC_TIMEOUT * 2) {
+            // items came in, but the peers went quiet before reporting or sending everything
+            fComplete = true;
+        }
 
-            if (pnode->HasFulfilledRequest("getsporks")) continue;
-            pnode->FulfilledRequest("getsporks");
+        if (fComplete) {
+            LogPrintf("CMasternodeSync::Process - asset %d complete, %d of %d peers reported\n", RequestedMasternodeAssets, nReported, RequestedMasternodeAttempt);
+            bool fBudget = RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET;
+            GetNextAsset();
 
-            pnode->PushMessage("getsporks"); //get current network sporks
-            if (RequestedMasternodeAttempt >= 2) GetNextAsset();
-            RequestedMasternodeAttempt++;
+            //try to activate our masternode if possible
+            if (fBudget) activeMasternode.ManageStatus();
             return;
         }
 
-        if (pnode->nVersion >= masternodePayments.GetMinMasternodePaymentsProto()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST) {
-                if (fDebug) LogPrintf("CMasternodeSync::Process() - lastMasternodeList %lld (GetTime() - MASTERNODE_SYNC_TIMEOUT) %lld\n", lastMasternodeList, GetTime() - MASTERNODE_SYNC_TIMEOUT * 2);
-                if (lastMasternodeList > 0 && lastMasternodeList < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnsync")) continue;
-                pnode->FulfilledRequest("mnsync");
-
-                // timeout
-                if (lastMasternodeList == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                mnodeman.DsegUpdate(pnode);
-                RequestedMasternodeAttempt++;
-                return;
-            }
-
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
-                if (lastMasternodeWinner > 0 && lastMasternodeWinner < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                    GetNextAsset();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("mnwsync")) continue;
-                pnode->FulfilledRequest("mnwsync");
-
-                // timeout
-                if (lastMasternodeWinner == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-                        LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                        RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                        RequestedMasternodeAttempt = 0;
-                        lastFailure = GetTime();
-                        nCountFailures++;
-                    } else {
-                        GetNextAsset();
-                    }
-                    return;
-                }
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                CBlockIndex* pindexPrev = chainActive.Tip();
-                if (pindexPrev == NULL) return;
-
-                int nMnCount = mnodeman.CountEnabled();
-                pnode->PushMessage("mnget", nMnCount); //sync payees
-                RequestedMasternodeAttempt++;
-
-                return;
+        // timeout
+        if (nLastItem == 0 && nReported == 0 &&
+            (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
+            if (RequestedMasternodeAssets == MASTERNODE_SYNC_LIST || RequestedMasternodeAssets == MASTERNODE_SYNC_MNW) {
+                AssetFailed();
+            } else {
+                // maybe there are no sporks or budgets at all, so just move on
+                bool fBudget = RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET;
+                GetNextAsset();
+                if (fBudget) activeMasternode.ManageStatus();
             }
+            return;
         }
+    }
 
-        if (pnode->nVersion >= ActiveProtocol()) {
-            if (RequestedMasternodeAssets == MASTERNODE_SYNC_BUDGET) {
-                //we'll start rejecting votes if we accidentally get set as synced too soon
-                if (lastBudgetItem > 0 && lastBudgetItem < GetTime() - MASTERNODE_SYNC_TIMEOUT * 2 && RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD) { //hasn't received a new item in the last five seconds, so we'll move to the
-                                                                                                                                                                 //LogPrintf("CMasternodeSync::Process - HasNextFinalizedBudget %d nCountFailures %d IsBudgetPropEmpty %d\n", budget.HasNextFinalizedBudget(), nCountFailures, IsBudgetPropEmpty());
-                                                                                                                                                                 //if(budget.HasNextFinalizedBudget() || nCountFailures >= 2 || IsBudgetPropEmpty()) {
-                    GetNextAsset();
-
-                    //try to activate our masternode if possible
-                    activeMasternode.ManageStatus();
-                    // } else { //we've failed to sync, this state will reject the next budget block
-                    //     LogPrintf("CMasternodeSync::Process - ERROR - Sync has failed, will retry later\n");
-                    //     RequestedMasternodeAssets = MASTERNODE_SYNC_FAILED;
-                    //     RequestedMasternodeAttempt = 0;
-                    //     lastFailure = GetTime();
-                    //     nCountFailures++;
-                    // }
-                    return;
-                }
-
-                // timeout
-                if (lastBudgetItem == 0 &&
-                    (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3 || GetTime() - nAssetSyncStarted > MASTERNODE_SYNC_TIMEOUT * 5)) {
-                    // maybe there is no budgets at all, so just finish syncing
-                    GetNextAsset();
-                    activeMasternode.ManageStatus();
-                    return;
-                }
-
-                if (pnode->HasFulfilledRequest("busync")) continue;
-                pnode->FulfilledRequest("busync");
-
-                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) return;
-
-                uint256 n = 0;
-                pnode->PushMessage("mnvs", n); //sync masternode votes
-                RequestedMasternodeAttempt++;
+    // ask several peers at once, until enough of them have answered
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (nReported >= MASTERNODE_SYNC_THRESHOLD) break;
+        if (RequestedMasternodeAttempt - nReported >= MASTERNODE_SYNC_PEERS) break;
+        if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD * 3) break;
 
-                return;
-            }
+        if (RequestAsset(pnode)) {
+            LogPrint("masternode", "CMasternodeSync::Process - asked peer=%d for asset %d\n", pnode->id, RequestedMasternodeAssets);
+            RequestedMasternodeAttempt++;
         }
     }
 }
@@ -8,6 +8,13 @@
 #ifndef MASTERNODE_SYNC_H
 #define MASTERNODE_SYNC_H
 
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
 #define MASTERNODE_SYNC_INITIAL 0
 #define MASTERNODE_SYNC_SPORKS 1
 #define MASTERNODE_SYNC_LIST 2
@@ -20,8 +27,12 @@
 
 #define MASTERNODE_SYNC_TIMEOUT 5
 #define MASTERNODE_SYNC_THRESHOLD 2
+#define MASTERNODE_SYNC_PEERS 3 // peers asked for an asset at the same time
+#define MASTERNODE_SYNC_QUIET 2 // seconds without new items before an asset counts as complete
 
+class CInv;
 class CMasternodeSync;
+class CNode;
 extern CMasternodeSync masternodeSync;
 
 //
@@ -30,6 +41,29 @@ extern CMasternodeSync masternodeSync;
 
 class CMasternodeSync
 {
+private:
+    // protects the inventory tracking and timings below
+    CCriticalSection cs;
+
+    // items of the current asset announced to us and not received yet, with the time of the announcement
+    std::map<uint256, int64_t> mapPendingItems;
+    int64_t lastInventory;
+
+    // start and end in ms of each asset, indexed MASTERNODE_SYNC_SPORKS..MASTERNODE_SYNC_BUDGET
+    int64_t nAssetTimeStarted[MASTERNODE_SYNC_BUDGET + 1];
+    int64_t nAssetTimeFinished[MASTERNODE_SYNC_BUDGET + 1];
+
+    void ReceivedItem(const uint256& hash);
+    /// Number of announced items of the current asset still expected to arrive
+    int CountPendingItems();
+    /// Time of the last item of the current asset received or announced
+    int64_t GetLastItemTime();
+    /// Number of peers that reported the size of the current asset
+    int GetReportedCount();
+    void AssetFailed();
+    /// Ask pnode for the current asset, false if it is not suitable or was asked already
+    bool RequestAsset(CNode* pnode);
+
 public:
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
@@ -67,8 +101,12 @@ public:
     void AddedMasternodeList(uint256 hash);
     void AddedMasternodeWinner(uint256 hash);
     void AddedBudgetItem(uint256 hash);
+    /// A peer announced an item we do not have and will request
+    void AddedInventory(const CInv& inv);
     void GetNextAsset();
     std::string GetSyncStatus();
+    /// Duration, items received and pending items per asset, for mnsync status
+    void GetAssetTimings(std::vector<std::pair<std::string, std::pair<int64_t, int> > >& vTimings, int& nPending);
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
     bool IsBudgetFinEmpty();
     bool IsBudgetPropEmpty();
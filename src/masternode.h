@@ -62,6 +62,8 @@ public:
     }
 
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true);
+    /// The message signed by the masternode key
+    std::string GetStrMessage() const;
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     void Relay();
 
@@ -192,7 +194,7 @@ public:
         return !(a.vin == b.vin);
     }
 
-    uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0);
+    uint256 CalculateScore(int mod = 1, int64_t nBlockHeight = 0) const;
 
     ADD_SERIALIZE_METHODS;
 
@@ -219,7 +221,7 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    int64_t SecondsSincePayment(int nMnCount = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -267,9 +269,9 @@ public:
         return cacheInputAge + (chainActive.Tip()->nHeight - cacheInputAgeBlock);
     }
 
-    std::string GetStatus();
+    std::string GetStatus() const;
 
-    std::string Status()
+    std::string Status() const
     {
         std::string strStatus = "ACTIVE";
 
@@ -282,7 +284,8 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    /// Time of the last payment within the last nMnCount * 1.25 blocks (-1: enabled masternodes), 0 if none
+    int64_t GetLastPaid(int nMnCount = -1) const;
     bool IsValidNetAddr();
 };
 
@@ -300,6 +303,8 @@ public:
 
     bool CheckAndUpdate(int& nDoS);
     bool CheckInputsAndAdd(int& nDos);
+    /// The message signed by the collateral key
+    std::string GetStrMessage() const;
     bool Sign(CKey& keyCollateralAddress);
     void Relay();
 
@@ -34,182 +34,33 @@ struct CompareScoreTxIn {
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
-//
-// CMasternodeDB
-//
-
-CMasternodeDB::CMasternodeDB()
-{
-    pathMN = GetDataDir() / "mncache.dat";
-    strMagicMessage = "MasternodeCache";
-}
-
-bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
-{
-    int64_t nStart = GetTimeMillis();
-
-    // serialize, checksum data up to that point, then append checksum
-    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
-    ssMasternodes << strMagicMessage;                   // masternode cache file specific magic message
-    ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
-    ssMasternodes << mnodemanToSave;
-    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    ssMasternodes << hash;
-
-    // open output file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "wb");
-    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
-
-    // Write and commit header, data
-    try {
-        fileout << ssMasternodes;
-    } catch (std::exception& e) {
-        return error("%s : Serialize or I/O error - %s", __func__, e.what());
-    }
-    //    FileCommit(fileout);
-    fileout.fclose();
-
-    LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrintf("  %s\n", mnodemanToSave.ToString());
-
-    return true;
-}
-
-CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bool fDryRun)
-{
-    int64_t nStart = GetTimeMillis();
-    // open input file, and associate with CAutoFile
-    FILE* file = fopen(pathMN.string().c_str(), "rb");
-    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull()) {
-        error("%s : Failed to open file %s", __func__, pathMN.string());
-        return FileError;
-    }
-
-    // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathMN);
-    int dataSize = fileSize - sizeof(uint256);
-    // Don't try to resize to a negative number if file is small
-    if (dataSize < 0)
-        dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
-
-    // read data and checksum from file
-    try {
-        filein.read((char*)&vchData[0], dataSize);
-        filein >> hashIn;
-    } catch (std::exception& e) {
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return HashReadError;
-    }
-    filein.fclose();
-
-    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
-
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
-    if (hashIn != hashTmp) {
-        error("%s : Checksum mismatch, data corrupted", __func__);
-        return IncorrectHash;
-    }
-
-    unsigned char pchMsgTmp[4];
-    std::string strMagicMessageTmp;
-    try {
-        // de-serialize file header (masternode cache file specific magic message) and ..
-
-        ssMasternodes >> strMagicMessageTmp;
-
-        // ... verify the message matches predefined one
-        if (strMagicMessage != strMagicMessageTmp) {
-            error("%s : Invalid masternode cache magic message", __func__);
-            return IncorrectMagicMessage;
-        }
-
-        // de-serialize file header (network specific magic number) and ..
-        ssMasternodes >> FLATDATA(pchMsgTmp);
-
-        // ... verify the network matches ours
-        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp))) {
-            error("%s : Invalid network magic number", __func__);
-            return IncorrectMagicNumber;
-        }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
-    } catch (std::exception& e) {
-        mnodemanToLoad.Clear();
-        error("%s : Deserialize or I/O error - %s", __func__, e.what());
-        return IncorrectFormat;
-    }
-
-    LogPrintf("Loaded info from mncache.dat  %dms\n", GetTimeMillis() - nStart);
-    LogPrintf("  %s\n", mnodemanToLoad.ToString());
-    if (!fDryRun) {
-        LogPrintf("Masternode manager - cleaning....\n");
-        mnodemanToLoad.CheckAndRemove(true);
-        LogPrintf("Masternode manager - result:\n");
-        LogPrintf("  %s\n", mnodemanToLoad.ToString());
-    }
-
-    return Ok;
-}
-
 void DumpMasternodes()
 {
-    int64_t nStart = GetTimeMillis();
-
     CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok) {
-        LogPrintf("Error reading mncache.dat: ");
-        if (readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
-    LogPrintf("Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
-
-    LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
+    mndb.Dump(mnodeman);
 }
 
 CMasternodeMan::CMasternodeMan()
 {
     nDsqCount = 0;
+    nSnapshotTime = 0;
+    nListVersion = 0;
 }
 
 int CMasternodeMan::stable_size ()
 {
     int nStable_size = 0;
     int nMinProtocol = ActiveProtocol();
-    int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
+    boost::shared_ptr<const CSporkSnapshot> pSporks = GetSporkSnapshot();
+    int64_t nMasternode_Min_Age = pSporks->GetValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
+    bool fEnforceAge = pSporks->IsActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
-        if (IsSporkActive (SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fEnforceAge) {
             nMasternode_Age = mn.lastPing.sigTime - mn.sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 continue; // Skip masternodes younger than (default) 8000 sec (MUST be > MASTERNODE_REMOVAL_SECONDS)
@@ -236,7 +87,9 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        listMasternodes.push_back(mn);
+        AddToIndexes(&listMasternodes.back());
+        ListChanged();
         return true;
     }
 
@@ -263,11 +116,92 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
 
+/// Whether the outpoint is missing from the UTXO set or spent in the mempool. Requires cs_main and mempool.cs.
+static bool IsOutPointSpent(CCoinsViewMemPool& viewMemPool, const COutPoint& outpoint)
+{
+    CCoins coins;
+    return mempool.mapNextTx.count(outpoint) || !viewMemPool.GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n);
+}
+
+void CMasternodeMan::CheckCollaterals()
+{
+    std::vector<COutPoint> vCollaterals;
+    {
+        LOCK(cs_collaterals);
+        vCollaterals.reserve(mapCollateralSpent.size());
+        for (boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher>::iterator it = mapCollateralSpent.begin(); it != mapCollateralSpent.end(); ++it)
+            vCollaterals.push_back(it->first);
+    }
+
+    std::vector<COutPoint> vSpent;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        BOOST_FOREACH (const COutPoint& outpoint, vCollaterals) {
+            if (IsOutPointSpent(viewMemPool, outpoint))
+                vSpent.push_back(outpoint);
+        }
+    }
+
+    LOCK(cs_collaterals);
+    BOOST_FOREACH (const COutPoint& outpoint, vSpent) {
+        boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher>::iterator it = mapCollateralSpent.find(outpoint);
+        if (it != mapCollateralSpent.end()) it->second = true;
+    }
+    LogPrint("masternode", "CMasternodeMan::CheckCollaterals - %d of %d collaterals spent\n", vSpent.size(), vCollaterals.size());
+}
+
+bool CMasternodeMan::IsCollateralSpent(const COutPoint& outpoint) const
+{
+    LOCK(cs_collaterals);
+    boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher>::const_iterator it = mapCollateralSpent.find(outpoint);
+    return it != mapCollateralSpent.end() && it->second;
+}
+
+bool CMasternodeMan::ConfirmCollateralSpent(const COutPoint& outpoint)
+{
+    if (!IsCollateralSpent(outpoint)) return false;
+
+    // the spend may have been disconnected or dropped from the mempool since it was flagged
+    bool fSpent;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if (!lockMain) return false;
+        LOCK(mempool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        fSpent = IsOutPointSpent(viewMemPool, outpoint);
+    }
+
+    if (!fSpent) {
+        LOCK(cs_collaterals);
+        boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher>::iterator it = mapCollateralSpent.find(outpoint);
+        if (it != mapCollateralSpent.end()) it->second = false;
+        LogPrint("masternode", "CMasternodeMan::ConfirmCollateralSpent - collateral %s is unspent again\n", outpoint.ToStringShort());
+    }
+    return fSpent;
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    if (tx.IsCoinBase()) return;
+
+    LOCK(cs_collaterals);
+    if (mapCollateralSpent.empty()) return;
+
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher>::iterator it = mapCollateralSpent.find(txin.prevout);
+        if (it != mapCollateralSpent.end() && !it->second) {
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s spent by %s\n", txin.prevout.ToStringShort(), tx.GetHash().ToString());
+            it->second = true;
+        }
+    }
+}
+
 void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 {
     Check();
@@ -275,8 +209,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -306,7 +240,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
                 }
             }
 
-            it = vMasternodes.erase(it);
+            RemoveFromIndexes(&(*it), (*it).pubKeyCollateralAddress, (*it).pubKeyMasternode);
+            it = listMasternodes.erase(it);
+            ListChanged();
         } else {
             ++it;
         }
@@ -367,7 +303,15 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    {
+        LOCK(cs_collaterals);
+        mapCollateralSpent.clear();
+    }
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    ListChanged();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -381,7 +325,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -411,40 +355,114 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+void CMasternodeMan::AddToIndexes(CMasternode* pmn)
+{
+    {
+        LOCK(cs_collaterals);
+        mapCollateralSpent.insert(make_pair(pmn->vin.prevout, false));
+    }
+    mapMasternodesByVin.insert(make_pair(pmn->vin.prevout, pmn));
+    mapMasternodesByPayee.insert(make_pair(GetScriptForDestination(pmn->pubKeyCollateralAddress.GetID()), pmn));
+    mapMasternodesByPubKey.insert(make_pair(pmn->pubKeyMasternode, pmn));
+}
+
+void CMasternodeMan::RemoveFromIndexes(CMasternode* pmn, const CPubKey& pubKeyCollateralAddressIn, const CPubKey& pubKeyMasternodeIn)
+{
+    boost::unordered_map<COutPoint, CMasternode*, CMasternodeOutPointHasher>::iterator itVin = mapMasternodesByVin.find(pmn->vin.prevout);
+    if (itVin != mapMasternodesByVin.end() && itVin->second == pmn) {
+        mapMasternodesByVin.erase(itVin);
+        LOCK(cs_collaterals);
+        mapCollateralSpent.erase(pmn->vin.prevout);
+    }
+
+    std::pair<std::multimap<CScript, CMasternode*>::iterator, std::multimap<CScript, CMasternode*>::iterator> rangePayee =
+        mapMasternodesByPayee.equal_range(GetScriptForDestination(pubKeyCollateralAddressIn.GetID()));
+    for (std::multimap<CScript, CMasternode*>::iterator it = rangePayee.first; it != rangePayee.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
+    }
+
+    std::pair<std::multimap<CPubKey, CMasternode*>::iterator, std::multimap<CPubKey, CMasternode*>::iterator> rangePubKey =
+        mapMasternodesByPubKey.equal_range(pubKeyMasternodeIn);
+    for (std::multimap<CPubKey, CMasternode*>::iterator it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    {
+        LOCK(cs_collaterals);
+        mapCollateralSpent.clear();
+    }
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        AddToIndexes(&mn);
+    ListChanged();
+}
+
+void CMasternodeMan::ListChanged()
+{
+    mapRankCache.clear();
+    pSnapshot.reset();
+    ++nListVersion;
+}
+
+void CMasternodeMan::UpdateKeys(CMasternode& mn, const CPubKey& pubKeyCollateralAddressOld, const CPubKey& pubKeyMasternodeOld)
+{
+    LOCK(cs);
+
+    CMasternode* pmn = Find(mn.vin);
+    if (pmn != &mn) return; // not one of ours
+
+    RemoveFromIndexes(pmn, pubKeyCollateralAddressOld, pubKeyMasternodeOld);
+    AddToIndexes(pmn);
+    ListChanged();
+}
+
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CScript, CMasternode*>::iterator it = mapMasternodesByPayee.find(payee);
+    return it == mapMasternodesByPayee.end() ? NULL : it->second;
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, CMasternode*, CMasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(vin.prevout);
+    return it == mapMasternodesByVin.end() ? NULL : it->second;
 }
 
-
 CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    std::multimap<CPubKey, CMasternode*>::iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    return it == mapMasternodesByPubKey.end() ? NULL : it->second;
+}
+
+boost::shared_ptr<const std::vector<CMasternode> > CMasternodeMan::GetMasternodeSnapshot()
+{
+    Check();
+
+    LOCK(cs);
+
+    if (!pSnapshot || GetTime() - nSnapshotTime >= MASTERNODE_CHECK_SECONDS) {
+        pSnapshot.reset(new std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end()));
+        nSnapshotTime = GetTime();
     }
-    return NULL;
+
+    return pSnapshot;
 }
 
 //
@@ -462,7 +480,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -478,7 +496,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -525,7 +543,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrintf("CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -549,7 +567,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -567,36 +585,37 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fFilterAge)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
-    int64_t nMasternode_Age = 0;
- 
- 
+    AssertLockHeld(cs);
 
     //make sure we know about this block
     uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    CMasternodeRankKey key(nBlockHeight, minProtocol, fOnlyActive, fFilterAge);
+    std::map<CMasternodeRankKey, CMasternodeRankTable>::iterator it = mapRankCache.find(key);
+    if (it != mapRankCache.end() && it->second.hashBlock == hash &&
+        GetTime() - it->second.nTimeCreated < MASTERNODES_RANK_CACHE_SECONDS)
+        return &it->second;
+
+    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    boost::shared_ptr<const CSporkSnapshot> pSporks = GetSporkSnapshot();
+    int64_t nMasternode_Min_Age = pSporks->GetValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
+    bool fEnforceAge = fFilterAge && pSporks->IsActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) {
-            LogPrintf("Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
-        }
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
+        if (mn.protocolVersion < minProtocol) continue; // Skip obsolete versions
+
+        // Skip masternodes younger than (default) 1 hour
+        if (fEnforceAge && mn.lastPing.sigTime - mn.sigTime < nMasternode_Min_Age) continue;
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = mn.lastPing.sigTime - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
-                LogPrintf("Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
-            }
-}
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
+
         uint256 n = mn.CalculateScore(1, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
@@ -605,47 +624,66 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
+    if (it == mapRankCache.end()) {
+        // heights far behind the tip are rarely asked for again
+        if (mapRankCache.size() >= MASTERNODES_RANK_CACHE_SIZE)
+            mapRankCache.erase(mapRankCache.begin());
+        it = mapRankCache.insert(make_pair(key, CMasternodeRankTable())).first;
+    }
+
+    CMasternodeRankTable& table = it->second;
+    table.hashBlock = hash;
+    table.nTimeCreated = GetTime();
+    table.vRanked.clear();
+    table.mapRank.clear();
+    table.vRanked.reserve(vecMasternodeScores.size());
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        table.vRanked.push_back(s.second);
+        table.mapRank[s.second.prevout] = table.vRanked.size();
     }
 
-    return -1;
+    LogPrint("masternode", "CMasternodeMan::GetRankTable - height %d, ranked %d of %d masternodes\n", nBlockHeight, table.vRanked.size(), listMasternodes.size());
+
+    return &table;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+void CMasternodeMan::InvalidateRankCache()
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
+    mapRankCache.clear();
+}
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+void CMasternodeMan::UpdatedSpork(int nSporkID, int64_t nValue)
+{
+    //masternode ranks depend on these
+    if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT || nSporkID == SPORK_16_MN_WINNER_MINIMUM_AGE)
+        InvalidateRankCache();
+}
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-        if (mn.protocolVersion < minProtocol) continue;
-        if (!mn.IsEnabled()) {
-            continue;
-        }
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive, true);
+    if (pTable == NULL) return -1;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    return pTable->GetRank(vin);
+}
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, true, false);
+    if (pTable == NULL) return vecMasternodeRanks;
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (const CTxIn& vin, pTable->vRanked) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(vin);
+        if (pmn) vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -653,33 +691,31 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, fOnlyActive, false);
+    if (pTable == NULL) return NULL;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    const CTxIn* pvin = pTable->GetByRank(nRank);
+    if (pvin == NULL) return NULL;
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    return Find(*pvin);
+}
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+void CMasternodeMan::GetTopMasternodes(int64_t nBlockHeight, int minProtocol, int nCount, std::map<COutPoint, CPubKey>& mapRet)
+{
+    LOCK(cs);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    mapRet.clear();
+    const CMasternodeRankTable* pTable = GetRankTable(nBlockHeight, minProtocol, true, true);
+    if (pTable == NULL) return;
 
-    return NULL;
+    for (int nRank = 1; nRank <= nCount; nRank++) {
+        const CTxIn* pvin = pTable->GetByRank(nRank);
+        if (pvin == NULL) break;
+        CMasternode* pmn = Find(*pvin);
+        if (pmn != NULL) mapRet[pvin->prevout] = pmn->pubKeyMasternode;
+    }
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -698,6 +734,100 @@ void CMasternodeMan::ProcessMasternodeConnections()
     }
 }
 
+void CMasternodeMan::ProcessPendingAnnounces()
+{
+    LOCK(cs_process_message);
+
+    if (vecPendingAnnounces.empty()) return;
+
+    int64_t nStart = GetTimeMicros();
+
+    // recover all signers up front, the checks below then find them ready
+    std::vector<std::pair<std::string, std::vector<unsigned char> > > vMessages;
+    BOOST_FOREACH (const CPendingAnnounce& pending, vecPendingAnnounces) {
+        if (pending.fPing) {
+            vMessages.push_back(make_pair(pending.mnp.GetStrMessage(), pending.mnp.vchSig));
+        } else {
+            vMessages.push_back(make_pair(pending.mnb.GetStrMessage(), pending.mnb.sig));
+            if (pending.mnb.lastPing != CMasternodePing())
+                vMessages.push_back(make_pair(pending.mnb.lastPing.GetStrMessage(), pending.mnb.lastPing.vchSig));
+        }
+    }
+    DarKsendSigner.RecoverBatch(vMessages);
+
+    std::vector<CPendingAnnounce> vecPending;
+    vecPending.swap(vecPendingAnnounces);
+    BOOST_FOREACH (CPendingAnnounce& pending, vecPending) {
+        if (pending.fPing)
+            ProcessPing(pending.pfrom, pending.mnp);
+        else
+            ProcessBroadcast(pending.pfrom, pending.mnb);
+    }
+    DarKsendSigner.ClearRecovered(vMessages);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CPendingAnnounce& pending, vecPending)
+            pending.pfrom->Release();
+    }
+
+    LogPrint("masternode", "CMasternodeMan::ProcessPendingAnnounces - %d messages, %d signatures in %.2fms\n",
+        vecPending.size(), vMessages.size(), (GetTimeMicros() - nStart) * 0.001);
+}
+
+void CMasternodeMan::ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb)
+{
+    int nDoS = 0;
+    if (!mnb.CheckAndUpdate(nDoS)) {
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+
+        //failed
+        return;
+    }
+
+    // make sure the vout that was signed is related to the transaction that spawned the Masternode
+    //  - this is expensive, so it's only done once per Masternode
+    if (!DarKsendSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
+        LogPrintf("mnb - Got mismatched pubkey and vin\n");
+        Misbehaving(pfrom->GetId(), 33);
+        return;
+    }
+
+    // make sure it's still unspent
+    //  - this is checked later by .check() in many places and by ThreadCheckDarKsendPool()
+    if (mnb.CheckInputsAndAdd(nDoS)) {
+        // use this as a peer
+        addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
+        masternodeSync.AddedMasternodeList(mnb.GetHash());
+    } else {
+        LogPrintf("mnb - Rejected Masternode entry %s\n", mnb.addr.ToString());
+
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+void CMasternodeMan::ProcessPing(CNode* pfrom, CMasternodePing& mnp)
+{
+    int nDoS = 0;
+    if (mnp.CheckAndUpdate(nDoS)) return;
+
+    if (nDoS > 0) {
+        // if anything significant failed, mark that node
+        Misbehaving(pfrom->GetId(), nDoS);
+    } else {
+        // if nothing significant failed, search existing Masternode list
+        CMasternode* pmn = Find(mnp.vin);
+        // if it's known, don't ask for the mnb, just return
+        if (pmn != NULL) return;
+    }
+
+    // something significant is broken or mn is unknown,
+    // we might have to ask for a masternode entry once
+    AskForMN(pfrom, mnp.vin);
+}
+
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
     if (fLiteMode) return; //disable all Darksend/Masternode related functionality
@@ -715,35 +845,17 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
         mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
 
-        int nDoS = 0;
-        if (!mnb.CheckAndUpdate(nDoS)) {
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-
-            //failed
-            return;
-        }
-
-        // make sure the vout that was signed is related to the transaction that spawned the Masternode
-        //  - this is expensive, so it's only done once per Masternode
-        if (!DarKsendSigner.IsVinAssociatedWithPubkey(mnb.vin, mnb.pubKeyCollateralAddress)) {
-            LogPrintf("mnb - Got mismatched pubkey and vin\n");
-            Misbehaving(pfrom->GetId(), 33);
-            return;
-        }
-
-        // make sure it's still unspent
-        //  - this is checked later by .check() in many places and by ThreadCheckDarKsendPool()
-        if (mnb.CheckInputsAndAdd(nDoS)) {
-            // use this as a peer
-            addrman.Add(CAddress(mnb.addr), pfrom->addr, 2 * 60 * 60);
-            masternodeSync.AddedMasternodeList(mnb.GetHash());
-        } else {
-            LogPrintf("mnb - Rejected Masternode entry %s\n", mnb.addr.ToString());
-
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+        CPendingAnnounce pending;
+        pending.pfrom = pfrom;
+        pending.fPing = false;
+        pending.mnb = mnb;
+        {
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
         }
+        vecPendingAnnounces.push_back(pending);
+        if (vecPendingAnnounces.size() >= MASTERNODES_VERIFY_BATCH_SIZE)
+            ProcessPendingAnnounces();
     }
 
     else if (strCommand == "mnp") { //Masternode Ping
@@ -755,23 +867,17 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
         mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
 
-        int nDoS = 0;
-        if (mnp.CheckAndUpdate(nDoS)) return;
-
-        if (nDoS > 0) {
-            // if anything significant failed, mark that node
-            Misbehaving(pfrom->GetId(), nDoS);
-        } else {
-            // if nothing significant failed, search existing Masternode list
-            CMasternode* pmn = Find(mnp.vin);
-            // if it's known, don't ask for the mnb, just return
-            if (pmn != NULL) return;
+        CPendingAnnounce pending;
+        pending.pfrom = pfrom;
+        pending.fPing = true;
+        pending.mnp = mnp;
+        {
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
         }
-
-        // something significant is broken or mn is unknown,
-        // we might have to ask for a masternode entry once
-        AskForMN(pfrom, mnp.vin);
-
+        vecPendingAnnounces.push_back(pending);
+        if (vecPendingAnnounces.size() >= MASTERNODES_VERIFY_BATCH_SIZE)
+            ProcessPendingAnnounces();
     } else if (strCommand == "dseg") { //Get Masternode list or specific entry
 
         CTxIn vin;
@@ -799,7 +905,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -915,6 +1021,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if (pmn->nLastDsee < sigTime) { //take the newest entry
                     LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
                     if (pmn->protocolVersion < GETHEADERS_VERSION) {
+                        CPubKey pubKeyMasternodeOld = pmn->pubKeyMasternode;
                         pmn->pubKeyMasternode = pubkey2;
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
@@ -922,6 +1029,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         pmn->addr = addr;
                         //fake ping
                         pmn->lastPing = CMasternodePing(vin);
+                        UpdateKeys(*pmn, pmn->pubKeyCollateralAddress, pubKeyMasternodeOld);
                     }
                     pmn->nLastDsee = sigTime;
                     pmn->Check();
@@ -1109,11 +1217,13 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString(), size() - 1);
-            vMasternodes.erase(it);
+            RemoveFromIndexes(&(*it), (*it).pubKeyCollateralAddress, (*it).pubKeyMasternode);
+            listMasternodes.erase(it);
+            ListChanged();
             break;
         }
         ++it;
@@ -1143,7 +1253,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -9,15 +9,25 @@
 #define MASTERNODEMAN_H
 
 #include "base58.h"
+#include "flat-database.h"
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
+
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_RANK_CACHE_SECONDS MASTERNODE_CHECK_SECONDS
+#define MASTERNODES_RANK_CACHE_SIZE 24
+#define MASTERNODES_VERIFY_BATCH_SIZE 256
 
 using namespace std;
 
@@ -26,31 +36,67 @@ class CMasternodeMan;
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
-/** Access to the MN database (mncache.dat)
+struct CMasternodeOutPointHasher {
+    size_t operator()(const COutPoint& out) const { return out.hash.GetLow64() ^ out.n; }
+};
+
+/** Selects which masternodes take part in a rank table */
+struct CMasternodeRankKey {
+    int64_t nBlockHeight;
+    int minProtocol;
+    bool fOnlyActive;
+    bool fFilterAge;
+
+    CMasternodeRankKey(int64_t nBlockHeightIn, int minProtocolIn, bool fOnlyActiveIn, bool fFilterAgeIn)
+        : nBlockHeight(nBlockHeightIn), minProtocol(minProtocolIn), fOnlyActive(fOnlyActiveIn), fFilterAge(fFilterAgeIn) {}
+
+    friend bool operator<(const CMasternodeRankKey& a, const CMasternodeRankKey& b)
+    {
+        if (a.nBlockHeight != b.nBlockHeight) return a.nBlockHeight < b.nBlockHeight;
+        if (a.minProtocol != b.minProtocol) return a.minProtocol < b.minProtocol;
+        if (a.fOnlyActive != b.fOnlyActive) return a.fOnlyActive < b.fOnlyActive;
+        return a.fFilterAge < b.fFilterAge;
+    }
+};
+
+/** Masternodes ordered by their score for one block, best first
  */
-class CMasternodeDB
+class CMasternodeRankTable
 {
-private:
-    boost::filesystem::path pathMN;
-    std::string strMagicMessage;
-
 public:
-    enum ReadResult {
-        Ok,
-        FileError,
-        HashReadError,
-        IncorrectHash,
-        IncorrectMagicMessage,
-        IncorrectMagicNumber,
-        IncorrectFormat
-    };
+    // block the scores were calculated from
+    uint256 hashBlock;
+    int64_t nTimeCreated;
+    // vRanked[0] has rank 1
+    std::vector<CTxIn> vRanked;
+    boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher> mapRank;
+
+    CMasternodeRankTable() : hashBlock(0), nTimeCreated(0) {}
+
+    /// Rank of the given masternode, -1 if it is not ranked
+    int GetRank(const CTxIn& vin) const
+    {
+        boost::unordered_map<COutPoint, int, CMasternodeOutPointHasher>::const_iterator it = mapRank.find(vin.prevout);
+        return it == mapRank.end() ? -1 : it->second;
+    }
 
-    CMasternodeDB();
-    bool Write(const CMasternodeMan& mnodemanToSave);
-    ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
+    /// Masternode with the given rank, NULL if there is none
+    const CTxIn* GetByRank(int nRank) const
+    {
+        if (nRank < 1 || nRank > (int)vRanked.size()) return NULL;
+        return &vRanked[nRank - 1];
+    }
 };
 
-class CMasternodeMan
+/** Access to the MN database (mncache.dat)
+ */
+class CMasternodeDB : public CFlatDB<CMasternodeMan>
+{
+public:
+    CMasternodeDB() : CFlatDB<CMasternodeMan>("mncache.dat", "MasternodeCache") {}
+};
+
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -59,14 +105,57 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, entries keep their address until they are removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes
+    boost::unordered_map<COutPoint, CMasternode*, CMasternodeOutPointHasher> mapMasternodesByVin;
+    std::multimap<CScript, CMasternode*> mapMasternodesByPayee;
+    std::multimap<CPubKey, CMasternode*> mapMasternodesByPubKey;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // rank tables already calculated, see GetRankTable
+    std::map<CMasternodeRankKey, CMasternodeRankTable> mapRankCache;
+
+    /// Rank table for a block height, calculated at most once per MASTERNODES_RANK_CACHE_SECONDS. Requires cs.
+    const CMasternodeRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fFilterAge);
+
+    // copy of the list shared by GetMasternodeSnapshot callers
+    boost::shared_ptr<const std::vector<CMasternode> > pSnapshot;
+    int64_t nSnapshotTime;
+    // bumped by ListChanged, lets other caches notice added, removed or replaced MNs
+    int nListVersion;
+
+    void AddToIndexes(CMasternode* pmn);
+    void RemoveFromIndexes(CMasternode* pmn, const CPubKey& pubKeyCollateralAddressIn, const CPubKey& pubKeyMasternodeIn);
+    void RebuildIndexes();
+
+    /// Drop everything derived from the list (rank tables, snapshot) and bump nListVersion. Requires cs.
+    void ListChanged();
+
+    // collateral outpoints of all MNs and whether a spend has been seen (cleared by ConfirmCollateralSpent if it went away); only ever locked last
+    mutable CCriticalSection cs_collaterals;
+    boost::unordered_map<COutPoint, bool, CMasternodeOutPointHasher> mapCollateralSpent;
+
+    // mnb or mnp waiting for its signatures to be checked in a batch, holding a reference to the node
+    struct CPendingAnnounce {
+        CNode* pfrom;
+        bool fPing;
+        CMasternodeBroadcast mnb;
+        CMasternodePing mnp;
+    };
+    // in order of arrival, protected by cs_process_message
+    std::vector<CPendingAnnounce> vecPendingAnnounces;
+
+    void ProcessBroadcast(CNode* pfrom, CMasternodeBroadcast& mnb);
+    void ProcessPing(CNode* pfrom, CMasternodePing& mnp);
+
+protected:
+    // CValidationInterface
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
 
 public:
     // Keep track of all broadcasts I've seen
@@ -83,7 +172,15 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // stored as a vector to stay compatible with existing mncache.dat files
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -105,6 +202,16 @@ public:
     /// Check all Masternodes
     void Check();
 
+    /// Look up the collaterals in the UTXO set and mempool, for entries that were not watched (loaded from mncache.dat)
+    void CheckCollaterals();
+
+    /// Whether a transaction spending this collateral has been seen
+    bool IsCollateralSpent(const COutPoint& outpoint) const;
+
+    /// Like IsCollateralSpent, but a flagged spend is looked up in the UTXO set and mempool first and cleared if it
+    /// is gone. Returns false when cs_main is busy, the caller checks again later.
+    bool ConfirmCollateralSpent(const COutPoint& outpoint);
+
     /// Check all Masternodes and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
@@ -113,6 +220,13 @@ public:
 
     int CountEnabled(int protocolVersion = -1);
 
+    /// Changes whenever a Masternode is added, removed or replaced
+    int GetListVersion() const
+    {
+        LOCK(cs);
+        return nListVersion;
+    }
+
     void DsegUpdate(CNode* pnode);
 
     /// Find an entry
@@ -129,22 +243,34 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod = 1, int64_t nBlockHeight = 0, int minProtocol = 0);
 
-    std::vector<CMasternode> GetFullMasternodeVector()
-    {
-        Check();
-        return vMasternodes;
-    }
+    /// Read-only copy of all entries, shared between callers and refreshed at most every MASTERNODE_CHECK_SECONDS
+    boost::shared_ptr<const std::vector<CMasternode> > GetMasternodeSnapshot();
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
     int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol = 0, bool fOnlyActive = true);
+    /// The nCount best ranked active masternodes (as GetMasternodeRank ranks them) with the keys they sign with
+    void GetTopMasternodes(int64_t nBlockHeight, int minProtocol, int nCount, std::map<COutPoint, CPubKey>& mapRet);
+
+    /// Forget all cached rank tables, to be called when the list or the sporks ranking depends on change
+    void InvalidateRankCache();
+    /// Spork change subscriber, drops the rank tables when a spork they depend on changes
+    void UpdatedSpork(int nSporkID, int64_t nValue);
 
     void ProcessMasternodeConnections();
 
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
+    /**
+     * Check the signatures of all queued mnb/mnp messages in parallel, then process them in order.
+     * ProcessMessage queues those messages and only flushes full batches; the message handler
+     * calls this once a peer has no more of them waiting and before any message that refers to the
+     * masternode list (mnw, mvote, ...), and ThreadCheckDarKsendPool every second.
+     */
+    void ProcessPendingAnnounces();
+
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 	/// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
 
@@ -154,6 +280,9 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Reindex an entry whose keys were changed in place
+    void UpdateKeys(CMasternode& mn, const CPubKey& pubKeyCollateralAddressOld, const CPubKey& pubKeyMasternodeOld);
 };
 
 #endif
@@ -76,6 +76,7 @@ struct ListenSocket {
 //
 bool fDiscover = true;
 bool fListen = true;
+bool fCaptureMessages = false;
 uint64_t nLocalServices = NODE_NETWORK;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
@@ -109,6 +110,9 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
+static boost::mutex messageHandlerMutex;
+// Set by WakeMessageHandler() under messageHandlerMutex, so a wakeup posted while the handler is busy is not lost
+static bool fMessageHandlerWake = false;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -570,6 +574,9 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    // Quality statistics are only tracked for addresses we connect out to
+    stats.fAddrStats = !fInbound && addrman.GetStats(addr, stats.addrStats);
 }
 #undef X
 
@@ -604,7 +611,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            WakeMessageHandler();
         }
     }
 
@@ -1197,7 +1204,8 @@ void ThreadOpenConnections()
         }
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose an address to connect to based on most recently seen,
+        // favouring addresses with low measured ping and block delivery latency
         //
         CAddress addrConnect;
 
@@ -1351,9 +1359,6 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 
 void ThreadMessageHandler()
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
         vector<CNode*> vNodesCopy;
@@ -1383,7 +1388,7 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize()) {
+                    if (pnode->nSendSize < SendBufferSize() && !pnode->fWaitBlockServer) {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
                         }
@@ -1408,8 +1413,12 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        {
+            boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
+            if (fSleep && !fMessageHandlerWake)
+                messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            fMessageHandlerWake = false;
+        }
     }
 }
 
@@ -1561,6 +1570,13 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
+void WakeMessageHandler()
+{
+    boost::lock_guard<boost::mutex> lock(messageHandlerMutex);
+    fMessageHandlerWake = true;
+    messageHandlerCondition.notify_one();
+}
+
 void StartNode(boost::thread_group& threadGroup)
 {
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -1918,6 +1934,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nSendSize = 0;
     nSendOffset = 0;
     hashContinue = 0;
+    fWaitBlockServer = false;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
@@ -1928,6 +1945,7 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nPingUsecTime = 0;
     fPingQueued = false;
     fDarKsendMaster = false;
+    pfileCapture = NULL;
 
     {
         LOCK(cs_nLastNodeId);
@@ -1953,9 +1971,44 @@ CNode::~CNode()
     if (pfilter)
         delete pfilter;
 
+    if (pfileCapture)
+        delete pfileCapture;
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
+void CNode::CaptureMessage(const std::string& strCommand, const CDataStream& vRecv, unsigned int nMessageSize, int64_t nTime)
+{
+    if (!pfileCapture) {
+        // One file per connection: <datadir>/captures/<connect time>-<peer id>.dat
+        boost::filesystem::path pathCapture = GetDataDir() / "captures";
+        TryCreateDirectory(pathCapture);
+        pathCapture /= strprintf("%d-%d.dat", nTimeConnected, id);
+        pfileCapture = new CAutoFile(fopen(pathCapture.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+        if (pfileCapture->IsNull()) {
+            LogPrintf("CaptureMessage() : cannot open %s\n", pathCapture.string());
+            return;
+        }
+    }
+    if (pfileCapture->IsNull())
+        return;
+
+    CCapturedMessage msg;
+    msg.nTime = nTime;
+    msg.nPeer = id;
+    msg.strCommand = strCommand;
+    msg.vPayload.assign(vRecv.begin(), vRecv.begin() + nMessageSize);
+    try {
+        *pfileCapture << msg;
+        // keep the capture complete up to the last message if the node is killed, and readable while it runs
+        if (fflush(pfileCapture->Get()) != 0)
+            throw std::ios_base::failure("fflush failed");
+    } catch (std::exception& e) {
+        LogPrintf("CaptureMessage() : %s, capture of peer=%d stopped\n", e.what(), id);
+        pfileCapture->fclose();
+    }
+}
+
 void CNode::AskFor(const CInv& inv)
 {
     if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "addrman.h"
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
@@ -30,7 +31,6 @@
 #include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
 
-class CAddrMan;
 class CBlockIndex;
 class CNode;
 
@@ -77,6 +77,8 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+/** Wake the message handler thread, e.g. when a peer it had to leave waiting can be served again */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
@@ -121,6 +123,7 @@ CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 extern bool fDiscover;
 extern bool fListen;
+extern bool fCaptureMessages;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
@@ -166,6 +169,36 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    bool fAddrStats;
+    CAddrStats addrStats;
+};
+
+
+/** A received message as written by -capturemessages, for offline replay */
+class CCapturedMessage
+{
+public:
+    int64_t nTime; // time (in microseconds) of message receipt.
+    NodeId nPeer;
+    std::string strCommand;
+    std::vector<char> vPayload;
+
+    CCapturedMessage()
+    {
+        nTime = 0;
+        nPeer = -1;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nTime);
+        READWRITE(nPeer);
+        READWRITE(strCommand);
+        READWRITE(vPayload);
+    }
 };
 
 
@@ -265,6 +298,8 @@ public:
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
+    // Per-peer capture file for -capturemessages, only touched by the message handler thread
+    CAutoFile* pfileCapture;
 
 protected:
     // Denial-of-service detection/prevention
@@ -284,6 +319,8 @@ protected:
 
 public:
     uint256 hashContinue;
+    //! Set by the message handler while the block server still has blocks to send to this peer
+    bool fWaitBlockServer;
     int nStartingHeight;
 
     // flood relay
@@ -614,6 +651,9 @@ public:
     void Subscribe(unsigned int nChannel, unsigned int nHops = 0);
     void CancelSubscribe(unsigned int nChannel);
     void CloseSocketDisconnect();
+
+    // Append a received message to this peer's capture file
+    void CaptureMessage(const std::string& strCommand, const CDataStream& vRecv, unsigned int nMessageSize, int64_t nTime);
 	bool DisconnectOldProtocol(int nVersionRequired, std::string strLastCommand = "");
 
     // Denial-of-service detection/prevention
@@ -27,7 +27,7 @@ Value mnbudget(const Array& params, bool fHelp)
         strCommand = params[0].get_str();
 
     if (fHelp ||
-        (strCommand != "vote-alias" && strCommand != "vote-many" && strCommand != "prepare" && strCommand != "submit" && strCommand != "vote" && strCommand != "getvotes" && strCommand != "getinfo" && strCommand != "show" && strCommand != "projection" && strCommand != "check" && strCommand != "nextblock"))
+        (strCommand != "vote-alias" && strCommand != "vote-many" && strCommand != "prepare" && strCommand != "submit" && strCommand != "vote" && strCommand != "getvotes" && strCommand != "getinfo" && strCommand != "show" && strCommand != "projection" && strCommand != "check" && strCommand != "nextblock" && strCommand != "sigcache"))
         throw runtime_error(
             "mnbudget \"command\"... ( \"passphrase\" )\n"
             "Vote or show current budgets\n"
@@ -42,7 +42,22 @@ Value mnbudget(const Array& params, bool fHelp)
             "  show               - Show all budgets\n"
             "  projection         - Show the projection of which proposals will be paid the next cycle\n"
             "  check              - Scan proposals and remove invalid\n"
-            "  nextblock          - Get next superblock for budget system\n");
+            "  nextblock          - Get next superblock for budget system\n"
+            "  sigcache           - Show how many vote signatures were verified or served from cache\n");
+
+    if (strCommand == "sigcache") {
+        int64_t nChecks, nHits, nFailures, nEvictions;
+        budgetVoteSigCache.GetStats(nChecks, nHits, nFailures, nEvictions);
+
+        Object obj;
+        obj.push_back(Pair("entries", budgetVoteSigCache.size()));
+        obj.push_back(Pair("maxentries", BUDGET_VOTE_SIGCACHE_SIZE));
+        obj.push_back(Pair("checks", nChecks));
+        obj.push_back(Pair("hits", nHits));
+        obj.push_back(Pair("failures", nFailures));
+        obj.push_back(Pair("evictions", nEvictions));
+        return obj;
+    }
 
     if (strCommand == "nextblock") {
         CBlockIndex* pindexPrev = chainActive.Tip();
@@ -478,11 +478,11 @@ Value masternode(const Array& params, bool fHelp)
         }
         Object obj;
 
-        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+        boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetMasternodeSnapshot();
         for (int nHeight = chainActive.Tip()->nHeight - nLast; nHeight < chainActive.Tip()->nHeight + 20; nHeight++) {
             uint256 nHigh = 0;
-            CMasternode* pBestMasternode = NULL;
-            BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+            const CMasternode* pBestMasternode = NULL;
+            BOOST_FOREACH (const CMasternode& mn, *pMasternodes) {
                 uint256 n = mn.CalculateScore(1, nHeight - 100);
                 if (n > nHigh) {
                     nHigh = n;
@@ -541,8 +541,9 @@ Value masternodelist(const Array& params, bool fHelp)
             obj.push_back(Pair(strVin, s.first));
         }
     } else {
-        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        boost::shared_ptr<const std::vector<CMasternode> > pMasternodes = mnodeman.GetMasternodeSnapshot();
+        int nMnCount = mnodeman.CountEnabled();
+        BOOST_FOREACH (const CMasternode& mn, *pMasternodes) {
             std::string strVin = mn.vin.prevout.ToStringShort();
             if (strMode == "activeseconds") {
                 if (strFilter != "" && strVin.find(strFilter) == string::npos) continue;
@@ -556,7 +557,7 @@ Value masternodelist(const Array& params, bool fHelp)
                 addrStream << setw(21) << strVin;
 
                 std::ostringstream stringStream;
-                stringStream << setw(9) << mn.Status() << " " << mn.protocolVersion << " " << CBitcoinAddress(mn.pubKeyCollateralAddress.GetID()).ToString() << " " << setw(21) << mn.addr.ToString() << " " << (int64_t)mn.lastPing.sigTime << " " << setw(8) << (int64_t)(mn.lastPing.sigTime - mn.sigTime) << " " << (int64_t)mn.GetLastPaid();
+                stringStream << setw(9) << mn.Status() << " " << mn.protocolVersion << " " << CBitcoinAddress(mn.pubKeyCollateralAddress.GetID()).ToString() << " " << setw(21) << mn.addr.ToString() << " " << (int64_t)mn.lastPing.sigTime << " " << setw(8) << (int64_t)(mn.lastPing.sigTime - mn.sigTime) << " " << (int64_t)mn.GetLastPaid(nMnCount);
                 std::string output = stringStream.str();
                 stringStream << " " << strVin;
                 if (strFilter != "" && stringStream.str().find(strFilter) == string::npos &&
@@ -568,7 +569,7 @@ Value masternodelist(const Array& params, bool fHelp)
             } else if (strMode == "lastpaid") {
                 if (strFilter != "" && mn.vin.prevout.hash.ToString().find(strFilter) == string::npos &&
                     strVin.find(strFilter) == string::npos) continue;
-                obj.push_back(Pair(strVin, (int64_t)mn.GetLastPaid()));
+                obj.push_back(Pair(strVin, (int64_t)mn.GetLastPaid(nMnCount)));
             } else if (strMode == "protocol") {
                 if (strFilter != "" && strFilter != strprintf("%d", mn.protocolVersion) &&
                     strVin.find(strFilter) == string::npos) continue;
@@ -10,6 +10,7 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
+#include "Instantx.h"
 #include "main.h"
 #include "masternode-sync.h"
 #include "net.h"
@@ -122,7 +123,8 @@ Value mnsync(const Array& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "mnsync [status|reset|next]\n"
-            "Returns the sync status or resets sync or switch to next asset.\n");
+            "Returns the sync status or resets sync or switch to next asset.\n"
+            "The status includes, per asset synced so far, the seconds it took (\"time\") and the distinct items received (\"items\").\n");
 
     std::string strMode = params[0].get_str();
 
@@ -147,6 +149,19 @@ Value mnsync(const Array& params, bool fHelp)
         obj.push_back(Pair("RequestedMasternodeAttempt", masternodeSync.RequestedMasternodeAttempt));
         obj.push_back(Pair("Status", masternodeSync.GetSyncStatus()));
 
+        std::vector<std::pair<std::string, std::pair<int64_t, int> > > vTimings;
+        int nPending = 0;
+        masternodeSync.GetAssetTimings(vTimings, nPending);
+        Object timings;
+        for (unsigned int i = 0; i < vTimings.size(); i++) {
+            Object asset;
+            asset.push_back(Pair("time", vTimings[i].second.first / 1000.0));
+            asset.push_back(Pair("items", vTimings[i].second.second));
+            timings.push_back(Pair(vTimings[i].first, asset));
+        }
+        obj.push_back(Pair("timings", timings));
+        obj.push_back(Pair("pendingItems", nPending));
+
         return obj;
     }
 
@@ -163,6 +178,57 @@ Value mnsync(const Array& params, bool fHelp)
     return "failure";
 }
 
+Value getinstantxinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getinstantxinfo\n"
+            "Returns how long SwiftTX lock requests took to collect enough votes.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"locks\": n,            (numeric) transaction locks being tracked\n"
+            "  \"lockRequests\": n,     (numeric) lock requests being tracked\n"
+            "  \"lockedInputs\": n,     (numeric) outpoints held by a lock\n"
+            "  \"pendingVotes\": n,     (numeric) votes waiting for signature verification\n"
+            "  \"completeLocks\": n,    (numeric) locks completed for wallet transactions\n"
+            "  \"recentVotes\": n,      (numeric) number of recent votes the average below is taken over\n"
+            "  \"averageVoteTime\": n,  (numeric) average time from lock request to vote, in milliseconds\n"
+            "  \"lockTimes\": {         (object) locks by time from request to lock, in milliseconds\n"
+            "    \"250\": n,            (numeric) locks completed within 250ms, and so on\n"
+            "    ...\n"
+            "    \"more\": n            (numeric) locks that took longer than the last bound\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getinstantxinfo", "") + HelpExampleRpc("getinstantxinfo", ""));
+
+    std::vector<std::pair<int64_t, int64_t> > vLockTimes;
+    int nPending = 0;
+    instantXLocks.GetLockTimes(vLockTimes, nPending);
+
+    Object lockTimes;
+    for (unsigned int i = 0; i < vLockTimes.size(); i++)
+        lockTimes.push_back(Pair(vLockTimes[i].first ? strprintf("%d", vLockTimes[i].first) : "more", vLockTimes[i].second));
+
+    int nVotes = 0;
+    int64_t nAverageVoteTime = 0;
+    instantXLocks.GetVoteTimes(nVotes, nAverageVoteTime);
+
+    Object obj;
+    {
+        LOCK(cs_instantx);
+        obj.push_back(Pair("locks", (int)mapTxLocks.size()));
+        obj.push_back(Pair("lockRequests", (int)mapTxLockReq.size()));
+        obj.push_back(Pair("lockedInputs", (int)mapLockedInputs.size()));
+    }
+    obj.push_back(Pair("pendingVotes", nPending));
+    obj.push_back(Pair("completeLocks", nCompleteTXLocks));
+    obj.push_back(Pair("recentVotes", nVotes));
+    obj.push_back(Pair("averageVoteTime", nAverageVoteTime));
+    obj.push_back(Pair("lockTimes", lockTimes));
+    return obj;
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<Object>
 {
@@ -8,6 +8,7 @@
 
 #include "rpcserver.h"
 
+#include "chainparams.h"
 #include "clientversion.h"
 #include "main.h"
 #include "net.h"
@@ -104,6 +105,12 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"addrstats\": {            (json object, outbound only) Connection quality recorded for this address\n"
+            "      \"connects\": n,           (numeric) Successful connections to this address\n"
+            "      \"avgpingtime\": n,        (numeric) Smoothed ping time in seconds, 0 if unknown\n"
+            "      \"blocks\": n,             (numeric) Number of requested blocks delivered\n"
+            "      \"avgblocktime\": n        (numeric) Smoothed block delivery time in seconds, 0 if unknown\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -150,6 +157,14 @@ Value getpeerinfo(const Array& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        if (stats.fAddrStats) {
+            Object addrstats;
+            addrstats.push_back(Pair("connects", stats.addrStats.nConnects));
+            addrstats.push_back(Pair("avgpingtime", ((double)stats.addrStats.nPingUsec) / 1e6));
+            addrstats.push_back(Pair("blocks", stats.addrStats.nBlocks));
+            addrstats.push_back(Pair("avgblocktime", ((double)stats.addrStats.nBlockUsec) / 1e6));
+            obj.push_back(Pair("addrstats", addrstats));
+        }
 
         ret.push_back(obj);
     }
@@ -157,6 +172,68 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value replaymessages(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "replaymessages \"file\"\n"
+            "\nFeed a message capture written by -capturemessages through the message handler (-regtest only).\n"
+            "Messages are processed in order as if received from one peer, and the time spent on each is reported.\n"
+            "Signature checks of consecutive mnb/mnp messages are batched and reported as command \"mnverify\".\n"
+            "\nArguments:\n"
+            "1. \"file\"     (string, required) The capture file, absolute or relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"messages\": n,            (numeric) The number of messages replayed\n"
+            "  \"elapsed\": n,             (numeric) Total processing time in seconds\n"
+            "  \"commands\": {\n"
+            "    \"command\": {\n"
+            "      \"count\": n,           (numeric) Number of messages with this command\n"
+            "      \"failed\": n,          (numeric) Number of them ProcessMessage rejected\n"
+            "      \"totaltime\": n,       (numeric) Total processing time in seconds\n"
+            "      \"avgtime\": n,         (numeric) Average processing time in seconds\n"
+            "      \"maxtime\": n          (numeric) Slowest message in seconds\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("replaymessages", "\"captures/1500000000-3.dat\"") + HelpExampleRpc("replaymessages", "\"captures/1500000000-3.dat\""));
+
+    if (!Params().MineBlocksOnDemand())
+        throw runtime_error("replaymessages for regression testing (-regtest mode) only");
+
+    boost::filesystem::path pathCapture(params[0].get_str());
+    if (!pathCapture.is_complete())
+        pathCapture = GetDataDir() / pathCapture;
+
+    std::map<std::string, CReplayStats> mapStats;
+    std::string strError;
+    if (!ReplayMessages(pathCapture, mapStats, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    int nMessages = 0;
+    int64_t nTotalUsec = 0;
+    Object commands;
+    for (std::map<std::string, CReplayStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        const CReplayStats& stats = it->second;
+        Object obj;
+        obj.push_back(Pair("count", stats.nCount));
+        obj.push_back(Pair("failed", stats.nFailed));
+        obj.push_back(Pair("totaltime", ((double)stats.nTotalUsec) / 1e6));
+        obj.push_back(Pair("avgtime", ((double)stats.nTotalUsec) / stats.nCount / 1e6));
+        obj.push_back(Pair("maxtime", ((double)stats.nMaxUsec) / 1e6));
+        commands.push_back(Pair(SanitizeString(it->first), obj));
+        nMessages += stats.nCount;
+        nTotalUsec += stats.nTotalUsec;
+    }
+
+    Object ret;
+    ret.push_back(Pair("messages", nMessages));
+    ret.push_back(Pair("elapsed", ((double)nTotalUsec) / 1e6));
+    ret.push_back(Pair("commands", commands));
+    return ret;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
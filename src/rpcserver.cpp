@@ -248,6 +248,7 @@ static const CRPCCommand vRPCCommands[] =
         {"network", "getnettotals", &getnettotals, true, true, false},
         {"network", "getpeerinfo", &getpeerinfo, true, false, false},
         {"network", "ping", &ping, true, false, false},
+        {"network", "replaymessages", &replaymessages, false, true, false},
 
         /* Block chain and UTXO */
         {"blockchain", "getblockchaininfo", &getblockchaininfo, true, false, false},
@@ -309,6 +310,7 @@ static const CRPCCommand vRPCCommands[] =
         {"salvage", "mnbudgetvoteraw", &mnbudgetvoteraw, true, true, false},
         {"salvage", "mnfinalbudget", &mnfinalbudget, true, true, false},
         {"salvage", "mnsync", &mnsync, true, true, false},
+        {"salvage", "getinstantxinfo", &getinstantxinfo, true, true, false},
         {"salvage", "spork", &spork, true, true, false},
 #ifdef ENABLE_WALLET
         {"salvage", "Darksend", &Darksend, false, false, true}, /* not threadSafe because of SendMoney */
@@ -6,6 +6,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode-budget.h"
+#include "masternodeman.h"
 #include "net.h"
 #include "protocol.h"
 #include "sync.h"
@@ -55,7 +56,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         }
 
         mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        sporkManager.SetActive(spork);
         sporkManager.Relay(spork);
 
         //does a task if needed
@@ -75,59 +76,71 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
     }
 }
 
-// grab the spork, otherwise say it's off
-bool IsSporkActive(int nSporkID)
+// default of a spork nobody signed an update for, -1 if unknown
+int64_t GetSporkDefault(int nSporkID)
 {
-    int64_t r = -1;
+    if (nSporkID == SPORK_2_INSTANTX) return SPORK_2_INSTANTX_DEFAULT;
+    if (nSporkID == SPORK_3_INSTANTX_BLOCK_FILTERING) return SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT;
+    if (nSporkID == SPORK_5_MAX_VALUE) return SPORK_5_MAX_VALUE_DEFAULT;
+    if (nSporkID == SPORK_7_MASTERNODE_SCANNING) return SPORK_7_MASTERNODE_SCANNING_DEFAULT;
+    if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) return SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT) return SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_10_MASTERNODE_PAY_UPDATED_NODES) return SPORK_10_MASTERNODE_PAY_UPDATED_NODES_DEFAULT;
+    if (nSporkID == SPORK_11_RESET_BUDGET) return SPORK_11_RESET_BUDGET_DEFAULT;
+    if (nSporkID == SPORK_12_RECONSIDER_BLOCKS) return SPORK_12_RECONSIDER_BLOCKS_DEFAULT;
+    if (nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) return SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
+    if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) return SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
+    if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) return SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
+    if (nSporkID == SPORK_16_MN_WINNER_MINIMUM_AGE) return SPORK_16_MN_WINNER_MINIMUM_AGE_DEFAULT;
 
-    if (mapSporksActive.count(nSporkID)) {
-        r = mapSporksActive[nSporkID].nValue;
-    } else {
-        if (nSporkID == SPORK_2_INSTANTX) r = SPORK_2_INSTANTX_DEFAULT;
-        if (nSporkID == SPORK_3_INSTANTX_BLOCK_FILTERING) r = SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT;
-        if (nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
-        if (nSporkID == SPORK_7_MASTERNODE_SCANNING) r = SPORK_7_MASTERNODE_SCANNING_DEFAULT;
-        if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) r = SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT) r = SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_10_MASTERNODE_PAY_UPDATED_NODES) r = SPORK_10_MASTERNODE_PAY_UPDATED_NODES_DEFAULT;
-        if (nSporkID == SPORK_11_RESET_BUDGET) r = SPORK_11_RESET_BUDGET_DEFAULT;
-        if (nSporkID == SPORK_12_RECONSIDER_BLOCKS) r = SPORK_12_RECONSIDER_BLOCKS_DEFAULT;
-        if (nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) r = SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
-        if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
-		if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
-        if (nSporkID == SPORK_16_MN_WINNER_MINIMUM_AGE) r = SPORK_16_MN_WINNER_MINIMUM_AGE_DEFAULT;
-
-        if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
-    }
+    return -1;
+}
+
+CSporkSnapshot::CSporkSnapshot()
+{
+    for (int i = 0; i < SPORK_COUNT; i++)
+        vValue[i] = GetSporkDefault(SPORK_START + i);
+}
+
+int64_t CSporkSnapshot::GetValue(int nSporkID) const
+{
+    if (nSporkID < SPORK_START || nSporkID > SPORK_END) return -1;
+    return vValue[nSporkID - SPORK_START];
+}
+
+bool CSporkSnapshot::IsActive(int nSporkID) const
+{
+    int64_t r = GetValue(nSporkID);
     if (r == -1) r = 4070908800; //return 2099-1-1 by default
 
     return r < GetTime();
 }
 
+void CSporkSnapshot::SetValue(int nSporkID, int64_t nValue)
+{
+    if (nSporkID < SPORK_START || nSporkID > SPORK_END) return;
+    vValue[nSporkID - SPORK_START] = nValue;
+}
+
+boost::shared_ptr<const CSporkSnapshot> GetSporkSnapshot()
+{
+    return sporkManager.GetSnapshot();
+}
+
+// grab the spork, otherwise say it's off
+bool IsSporkActive(int nSporkID)
+{
+    boost::shared_ptr<const CSporkSnapshot> pSporks = sporkManager.GetSnapshot();
+    if (pSporks->GetValue(nSporkID) == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
+
+    return pSporks->IsActive(nSporkID);
+}
+
 // grab the value of the spork on the network, or the default
 int64_t GetSporkValue(int nSporkID)
 {
-    int64_t r = -1;
-
-    if (mapSporksActive.count(nSporkID)) {
-        r = mapSporksActive[nSporkID].nValue;
-    } else {
-        if (nSporkID == SPORK_2_INSTANTX) r = SPORK_2_INSTANTX_DEFAULT;
-        if (nSporkID == SPORK_3_INSTANTX_BLOCK_FILTERING) r = SPORK_3_INSTANTX_BLOCK_FILTERING_DEFAULT;
-        if (nSporkID == SPORK_5_MAX_VALUE) r = SPORK_5_MAX_VALUE_DEFAULT;
-        if (nSporkID == SPORK_7_MASTERNODE_SCANNING) r = SPORK_7_MASTERNODE_SCANNING_DEFAULT;
-        if (nSporkID == SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT) r = SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT) r = SPORK_9_MASTERNODE_BUDGET_ENFORCEMENT_DEFAULT;
-        if (nSporkID == SPORK_10_MASTERNODE_PAY_UPDATED_NODES) r = SPORK_10_MASTERNODE_PAY_UPDATED_NODES_DEFAULT;
-        if (nSporkID == SPORK_11_RESET_BUDGET) r = SPORK_11_RESET_BUDGET_DEFAULT;
-        if (nSporkID == SPORK_12_RECONSIDER_BLOCKS) r = SPORK_12_RECONSIDER_BLOCKS_DEFAULT;
-        if (nSporkID == SPORK_13_ENABLE_SUPERBLOCKS) r = SPORK_13_ENABLE_SUPERBLOCKS_DEFAULT;
-        if (nSporkID == SPORK_14_NEW_PROTOCOL_ENFORCEMENT) r = SPORK_14_NEW_PROTOCOL_ENFORCEMENT_DEFAULT;
-		if (nSporkID == SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2) r = SPORK_15_NEW_PROTOCOL_ENFORCEMENT_2_DEFAULT;
-        if (nSporkID == SPORK_16_MN_WINNER_MINIMUM_AGE) r = SPORK_16_MN_WINNER_MINIMUM_AGE_DEFAULT;
-
-        if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
-    }
+    int64_t r = sporkManager.GetSnapshot()->GetValue(nSporkID);
+    if (r == -1) LogPrintf("GetSpork::Unknown Spork %d\n", nSporkID);
 
     return r;
 }
@@ -228,13 +241,33 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
     if (Sign(msg)) {
         Relay(msg);
         mapSporks[msg.GetHash()] = msg;
-        mapSporksActive[nSporkID] = msg;
+        SetActive(msg);
         return true;
     }
 
     return false;
 }
 
+boost::shared_ptr<const CSporkSnapshot> CSporkManager::GetSnapshot()
+{
+    LOCK(cs);
+    return pSnapshot;
+}
+
+void CSporkManager::SetActive(const CSporkMessage& spork)
+{
+    mapSporksActive[spork.nSporkID] = spork;
+
+    {
+        LOCK(cs);
+        CSporkSnapshot* pNew = new CSporkSnapshot(*pSnapshot);
+        pNew->SetValue(spork.nSporkID, spork.nValue);
+        pSnapshot.reset(pNew);
+    }
+
+    NotifySporkChanged(spork.nSporkID, spork.nValue);
+}
+
 void CSporkManager::Relay(CSporkMessage& msg)
 {
     CInv inv(MSG_SPORK, msg.GetHash());
@@ -18,6 +18,8 @@
 #include "Darksend.h"
 #include "protocol.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/signals2/signal.hpp>
 
 using namespace std;
 using namespace boost;
@@ -28,6 +30,7 @@ using namespace boost;
 */
 #define SPORK_START 10001
 #define SPORK_END 10015
+#define SPORK_COUNT (SPORK_END - SPORK_START + 1)
 
 #define SPORK_2_INSTANTX 10001
 #define SPORK_3_INSTANTX_BLOCK_FILTERING 10002
@@ -59,14 +62,17 @@ using namespace boost;
                                                                   // Set this to zero to emulate classic behaviour
 class CSporkMessage;
 class CSporkManager;
+class CSporkSnapshot;
 
 extern std::map<uint256, CSporkMessage> mapSporks;
 extern std::map<int, CSporkMessage> mapSporksActive;
 extern CSporkManager sporkManager;
 
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
+int64_t GetSporkDefault(int nSporkID);
 int64_t GetSporkValue(int nSporkID);
 bool IsSporkActive(int nSporkID);
+boost::shared_ptr<const CSporkSnapshot> GetSporkSnapshot();
 void ExecuteSpork(int nSporkID, int nValue);
 void ReprocessBlocks(int nBlocks);
 
@@ -102,17 +108,51 @@ public:
 };
 
 
+/**
+ * Values of all sporks at one point in time, indexed by nSporkID - SPORK_START.
+ * A published snapshot is never modified: an update copies it, changes the copy and
+ * swaps that in, so callers looking up several sporks in a loop take one snapshot
+ * and read it without any lock.
+ */
+class CSporkSnapshot
+{
+private:
+    int64_t vValue[SPORK_COUNT];
+
+public:
+    /// Snapshot holding the default of every spork
+    CSporkSnapshot();
+
+    /// The network value of the spork or its default, -1 if it is unknown
+    int64_t GetValue(int nSporkID) const;
+    /// Whether the spork value (a time) has passed
+    bool IsActive(int nSporkID) const;
+    void SetValue(int nSporkID, int64_t nValue);
+};
+
 class CSporkManager
 {
 private:
     std::vector<unsigned char> vchSig;
     std::string strMasterPrivKey;
 
+    // protects pSnapshot
+    CCriticalSection cs;
+    boost::shared_ptr<const CSporkSnapshot> pSnapshot;
+
 public:
-    CSporkManager()
+    CSporkManager() : pSnapshot(new CSporkSnapshot())
     {
     }
 
+    /// Called after a spork update took effect, for subsystems caching anything derived from it
+    boost::signals2::signal<void(int nSporkID, int64_t nValue)> NotifySporkChanged;
+
+    /// The current values, shared between callers
+    boost::shared_ptr<const CSporkSnapshot> GetSnapshot();
+    /// Make a received or signed spork the active one and publish the new values
+    void SetActive(const CSporkMessage& spork);
+
     std::string GetSporkNameByID(int id);
     int GetSporkIDByName(std::string strName);
     bool UpdateSpork(int nSporkID, int64_t nValue);
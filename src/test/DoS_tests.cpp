@@ -16,6 +16,7 @@
 #include "serialize.h"
 #include "util.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -26,13 +27,16 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern uint64_t nOrphanBytes;
 
 CService ip(uint32_t i)
 {
@@ -187,13 +191,105 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    const uint64_t nNoByteLimit = std::numeric_limits<uint64_t>::max();
+    LimitOrphanTxSize(40, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    uint64_t nHalfBytes = nOrphanBytes / 2;
+    LimitOrphanTxSize(10, nHalfBytes);
+    BOOST_CHECK(nOrphanBytes <= nHalfBytes);
+    LimitOrphanTxSize(0, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(nOrphanBytes == 0);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    std::vector<CMutableTransaction> vtx(4);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout.n = i;
+        vtx[i].vin[0].prevout.hash = GetRandHash();
+        vtx[i].vin[0].scriptSig << OP_1;
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].nValue = 1*CENT;
+        vtx[i].vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+    unsigned int nTxSize = CTransaction(vtx[0]).GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+
+    // A peer may only fill its quota of the pool:
+    uint64_t nMaxOrphanTxSizeSaved = nMaxOrphanTxSize;
+    nMaxOrphanTxSize = nTxSize * 100 / ORPHAN_TX_PEER_QUOTA_PCT;
+    BOOST_CHECK(AddOrphanTx(vtx[0], 1));
+    BOOST_CHECK(!AddOrphanTx(vtx[1], 1));
+    BOOST_CHECK(AddOrphanTx(vtx[1], 2));
+    BOOST_CHECK(nOrphanBytes == 2 * nTxSize);
+    EraseOrphansFor(1);
+    BOOST_CHECK(AddOrphanTx(vtx[2], 1));
+    nMaxOrphanTxSize = nMaxOrphanTxSizeSaved;
+
+    // Orphans are indexed by the exact outpoint they spend:
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(vtx[2].vin[0].prevout));
+    BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(vtx[2].vin[0].prevout.hash, 0)));
+
+    // Expired orphans are swept out:
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    BOOST_CHECK(AddOrphanTx(vtx[3], 3));
+    LimitOrphanTxSize(100, std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.size() == 1);
+    BOOST_CHECK(mapOrphanTransactions.count(vtx[3].GetHash()));
+    SetMockTime(0);
+
+    LimitOrphanTxSize(0, std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_flood)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    // One peer floods small orphans with the default limits, another peer sends a single orphan
+    std::vector<CMutableTransaction> vtx(2 * DEFAULT_MAX_ORPHAN_TRANSACTIONS + 1);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].prevout.n = 0;
+        vtx[i].vin[0].prevout.hash = GetRandHash();
+        vtx[i].vin[0].scriptSig << OP_1;
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].nValue = 1*CENT;
+        vtx[i].vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    }
+    BOOST_CHECK(nMaxOrphanTransactions == DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK(nMaxOrphanTxSize == DEFAULT_MAX_ORPHAN_TX_SIZE);
+
+    CTransaction txOther(vtx.back());
+    BOOST_CHECK(AddOrphanTx(txOther, 2));
+    unsigned int nAccepted = 0;
+    for (unsigned int i = 0; i + 1 < vtx.size(); i++) {
+        if (AddOrphanTx(vtx[i], 1))
+            nAccepted++;
+        LimitOrphanTxSize(nMaxOrphanTransactions, nMaxOrphanTxSize);
+    }
+
+    // The flooding peer is held to its share and the other peer's orphan survives
+    BOOST_CHECK(nAccepted == DEFAULT_MAX_ORPHAN_TRANSACTIONS * ORPHAN_TX_PEER_QUOTA_PCT / 100);
+    BOOST_CHECK(mapOrphanTransactions.count(txOther.GetHash()));
+
+    // Once the flooding peer's orphans are gone it may store orphans again
+    EraseOrphansFor(1);
+    BOOST_CHECK(mapOrphanTransactions.size() == 1);
+    BOOST_CHECK(AddOrphanTx(vtx[0], 1));
+
+    LimitOrphanTxSize(0, std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.empty());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
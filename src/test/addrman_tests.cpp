@@ -0,0 +1,90 @@
+// Copyright (c) 2018 The Salvage developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// Gives access to the entries, to look at what Select() would weigh them by
+class CAddrManTest : public CAddrMan
+{
+public:
+    CAddrInfo* Find(const CNetAddr& addr)
+    {
+        return CAddrMan::Find(addr);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_latency)
+{
+    CAddrManTest addrman;
+    CNetAddr source("252.2.2.2");
+    CService addr("250.1.1.1", 8333);
+    BOOST_CHECK(addrman.Add(CAddress(addr), source));
+
+    CAddrStats stats;
+    BOOST_CHECK(addrman.GetStats(addr, stats));
+    BOOST_CHECK_EQUAL(stats.nConnects, 0);
+    BOOST_CHECK_EQUAL(stats.nPingUsec, 0);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 0);
+
+    // the first sample is taken as is, later ones are blended in with weight 2/8
+    addrman.UpdatePing(addr, 100000);
+    addrman.UpdatePing(addr, 300000);
+    // unknown pings, other ports and unknown addresses are ignored
+    addrman.UpdatePing(addr, 0);
+    addrman.UpdatePing(CService("250.1.1.1", 8334), 1);
+    addrman.UpdatePing(CService("250.1.1.2", 8333), 1);
+
+    addrman.BlockDelivered(addr, 1000000);
+    addrman.BlockDelivered(addr, 3000000);
+    addrman.BlockDelivered(addr, -1);
+
+    addrman.Good(addr);
+
+    BOOST_CHECK(addrman.GetStats(addr, stats));
+    BOOST_CHECK_EQUAL(stats.nConnects, 1);
+    BOOST_CHECK_EQUAL(stats.nPingUsec, 150000);
+    BOOST_CHECK_EQUAL(stats.nBlockUsec, 1500000);
+    BOOST_CHECK_EQUAL(stats.nBlocks, 2);
+    BOOST_CHECK(!addrman.GetStats(CService("250.1.1.2", 8333), stats));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_quality)
+{
+    CAddrManTest addrman;
+    CNetAddr source("252.2.2.2");
+    CService addrUnknown("250.1.1.1", 8333);
+    CService addrFast("250.2.1.1", 8333);
+    CService addrSlow("250.3.1.1", 8333);
+    addrman.Add(CAddress(addrUnknown), source);
+    addrman.Add(CAddress(addrFast), source);
+    addrman.Add(CAddress(addrSlow), source);
+
+    addrman.UpdatePing(addrFast, ADDRMAN_REFERENCE_PING_USEC / 4);
+    addrman.BlockDelivered(addrFast, ADDRMAN_REFERENCE_BLOCK_USEC / 4);
+    addrman.UpdatePing(addrSlow, ADDRMAN_REFERENCE_PING_USEC * 4);
+    addrman.BlockDelivered(addrSlow, ADDRMAN_REFERENCE_BLOCK_USEC * 100);
+
+    CAddrInfo* pinfoUnknown = addrman.Find(addrUnknown);
+    CAddrInfo* pinfoFast = addrman.Find(addrFast);
+    CAddrInfo* pinfoSlow = addrman.Find(addrSlow);
+    BOOST_CHECK_EQUAL(pinfoUnknown->GetQuality(), 1.0);
+    BOOST_CHECK_CLOSE(pinfoFast->GetQuality(), 1.6 * 1.6, 0.001);
+    // 2 / (1 + 4) for the ping, the block time is capped at 0.25
+    BOOST_CHECK_CLOSE(pinfoSlow->GetQuality(), 0.4 * 0.25, 0.001);
+
+    // all else being equal, the chance of selection scales with the quality
+    int64_t nNow = GetAdjustedTime();
+    double fChance = pinfoUnknown->GetChance(nNow);
+    BOOST_CHECK_CLOSE(pinfoFast->GetChance(nNow), fChance * pinfoFast->GetQuality(), 0.001);
+    BOOST_CHECK_CLOSE(pinfoSlow->GetChance(nNow), fChance * pinfoSlow->GetQuality(), 0.001);
+    BOOST_CHECK(pinfoFast->GetChance(nNow) > fChance && fChance > pinfoSlow->GetChance(nNow));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+// Copyright (c) 2018 The Salvage developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternode-payments.h"
+#include "utiltime.h"
+
+#include <algorithm>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CScript PayeeScript(int n)
+{
+    return CScript() << OP_DUP << OP_HASH160 << CScriptNum(n) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+// Proof of work block paying payee at vout[1] of the coinbase
+static CBlock PowBlock(const CScript& payee)
+{
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(2);
+    txCoinbase.vout[0].scriptPubKey = PayeeScript(-1);
+    txCoinbase.vout[0].nValue = 9 * COIN;
+    txCoinbase.vout[1].scriptPubKey = payee;
+    txCoinbase.vout[1].nValue = 1 * COIN;
+
+    CBlock block;
+    block.vtx.push_back(CTransaction(txCoinbase));
+    return block;
+}
+
+// Proof of stake block whose coinstake pays the staker and then vout.back()
+static CBlock PosBlock(const CScript& staker, const CScript& last)
+{
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].SetEmpty();
+
+    CMutableTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout.hash = 1;
+    txCoinStake.vin[0].prevout.n = 0;
+    txCoinStake.vout.resize(3);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].scriptPubKey = staker;
+    txCoinStake.vout[1].nValue = 100 * COIN;
+    txCoinStake.vout[2].scriptPubKey = last;
+    txCoinStake.vout[2].nValue = 1 * COIN;
+
+    CBlock block;
+    block.vtx.push_back(CTransaction(txCoinbase));
+    block.vtx.push_back(CTransaction(txCoinStake));
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(mnpayments_tests)
+
+BOOST_AUTO_TEST_CASE(lastpaid_payee)
+{
+    CScript payee;
+    BOOST_CHECK(CMasternodeLastPaid::GetPayee(PowBlock(PayeeScript(1)), payee));
+    BOOST_CHECK(payee == PayeeScript(1));
+
+    BOOST_CHECK(CMasternodeLastPaid::GetPayee(PosBlock(PayeeScript(2), PayeeScript(3)), payee));
+    BOOST_CHECK(payee == PayeeScript(3));
+
+    // split stake, no masternode output
+    BOOST_CHECK(!CMasternodeLastPaid::GetPayee(PosBlock(PayeeScript(2), PayeeScript(2)), payee));
+}
+
+BOOST_AUTO_TEST_CASE(lastpaid_connect_disconnect)
+{
+    CMasternodeLastPaid lastPaid;
+
+    lastPaid.BlockConnected(PowBlock(PayeeScript(1)), 10);
+    lastPaid.BlockConnected(PowBlock(PayeeScript(2)), 11);
+    lastPaid.BlockConnected(PowBlock(PayeeScript(1)), 12);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(1)), 12);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(2)), 11);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(3)), 0);
+
+    // reorg back to height 10
+    lastPaid.BlockDisconnected(PowBlock(PayeeScript(1)), 12);
+    lastPaid.BlockDisconnected(PowBlock(PayeeScript(2)), 11);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(1)), 10);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(2)), 0);
+    BOOST_CHECK_EQUAL(lastPaid.size(), 1);
+
+    // only the most recent payments are remembered
+    for (int i = 0; i < MNPAYMENTS_LASTPAID_HISTORY + 2; i++)
+        lastPaid.BlockConnected(PowBlock(PayeeScript(1)), 20 + i);
+    for (int i = MNPAYMENTS_LASTPAID_HISTORY + 1; i >= 0; i--)
+        lastPaid.BlockDisconnected(PowBlock(PayeeScript(1)), 20 + i);
+    BOOST_CHECK_EQUAL(lastPaid.GetLastPaidHeight(PayeeScript(1)), 0);
+}
+
+BOOST_AUTO_TEST_CASE(lastpaid_queue_benchmark)
+{
+    // queue selection over 5000 masternodes: look up every payee, then sort oldest first
+    const int nMasternodes = 5000;
+    const int nBlocks = nMasternodes * 5 / 4;
+
+    vector<CScript> vPayees;
+    for (int i = 0; i < nMasternodes; i++)
+        vPayees.push_back(PayeeScript(i));
+
+    CMasternodeLastPaid lastPaid;
+    int64_t nStart = GetTimeMicros();
+    for (int nHeight = 1; nHeight <= nBlocks; nHeight++)
+        lastPaid.BlockConnected(PowBlock(vPayees[(nHeight * 7919) % nMasternodes]), nHeight);
+    int64_t nConnected = GetTimeMicros();
+
+    vector<pair<int, int> > vecLastPaid;
+    for (int i = 0; i < nMasternodes; i++)
+        vecLastPaid.push_back(make_pair(lastPaid.GetLastPaidHeight(vPayees[i]), i));
+    sort(vecLastPaid.begin(), vecLastPaid.end());
+    int64_t nSelected = GetTimeMicros();
+
+    BOOST_TEST_MESSAGE(strprintf("lastpaid: connect %d blocks %.2fms, select among %d masternodes %.2fms",
+        nBlocks, (nConnected - nStart) * 0.001, nMasternodes, (nSelected - nConnected) * 0.001));
+
+    // 7919 is coprime to 5000, so every payee was paid and the oldest payment is the first not repeated
+    BOOST_CHECK_EQUAL(vecLastPaid.front().first, nBlocks - nMasternodes + 1);
+    BOOST_CHECK_EQUAL(vecLastPaid.back().first, nBlocks);
+    BOOST_CHECK_EQUAL(lastPaid.size(), nMasternodes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
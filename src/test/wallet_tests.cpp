@@ -3,9 +3,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
-
+#include "Instantx.h"
+#include "main.h"
+#include "random.h"
+#include "utilmoneystr.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <limits>
 #include <set>
 #include <stdint.h>
+#include <stdlib.h>
 #include <utility>
 #include <vector>
 
@@ -23,6 +31,10 @@ using namespace std;
 
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
+// Tests these internal-to-wallet.cpp methods:
+extern void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations, int64_t nDeadline);
+extern bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTargetValue, vector<char>& vfBest, int nMaxTries, int64_t nDeadline);
+
 BOOST_AUTO_TEST_SUITE(wallet_tests)
 
 static CWallet wallet;
@@ -305,4 +317,260 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static void get_values(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue)
+{
+    vValue.clear();
+    BOOST_FOREACH(const COutput& output, vCoins)
+        vValue.push_back(make_pair(output.tx->vout[output.i].nValue, make_pair(output.tx, (unsigned int)output.i)));
+    sort(vValue.rbegin(), vValue.rend());
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_bnb)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
+    vector<char> vfBest;
+    CAmount nBest;
+    int64_t nNoDeadline = std::numeric_limits<int64_t>::max();
+
+    LOCK(wallet.cs_wallet);
+
+    // 10 cents can only be paid exactly with the two 5 cent coins. The knapsack reaches that
+    // only if its random pass skips all thirty 6 cent coins, so it settles for 11 cents
+    empty_wallet();
+    for (int i = 0; i < 30; i++)
+        add_coin(6 * CENT);
+    add_coin(5 * CENT);
+    add_coin(5 * CENT);
+    get_values(vValue);
+
+    ApproximateBestSubset(vValue, 190 * CENT, 10 * CENT, vfBest, nBest, 1000, 0);
+    BOOST_CHECK(nBest != 10 * CENT);
+
+    BOOST_CHECK(SelectCoinsBnB(vValue, 10 * CENT, vfBest, COIN_SELECTION_BNB_TRIES, nNoDeadline));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(10 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // the search visits the totals 0, 6, 12, 6, 11, 6, 0, 5 and 10 cents: nine tries
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 10 * CENT, vfBest, 8, nNoDeadline));
+    BOOST_CHECK(SelectCoinsBnB(vValue, 10 * CENT, vfBest, 9, nNoDeadline));
+
+    // even coins never add up to an odd target and the search space is far too large to
+    // exhaust, so only the time budget ends this search
+    empty_wallet();
+    for (int i = 0; i < 40; i++)
+        add_coin((100 + 2 * i) * CENT);
+    get_values(vValue);
+    BOOST_CHECK(!SelectCoinsBnB(vValue, 2001 * CENT, vfBest, std::numeric_limits<int>::max(), GetTimeMillis() - 1));
+
+    // the knapsack still runs a few iterations once the time budget is gone, it never
+    // falls back to spending every coin
+    ApproximateBestSubset(vValue, 5560 * CENT, 2001 * CENT, vfBest, nBest, 1000, GetTimeMillis() - 1);
+    BOOST_CHECK(nBest >= 2001 * CENT && nBest < 5560 * CENT);
+    BOOST_CHECK(std::count(vfBest.begin(), vfBest.end(), true) < (int)vfBest.size());
+
+    empty_wallet();
+}
+
+/**
+ * Manual benchmark of coin selection among 20000 coins of synthetic distributions, as on
+ * pool and exchange wallets, against the knapsack alone. Not run by make check, run it with
+ *   SALVAGE_BENCHMARK=1 test_salvage --run_test=wallet_tests/coin_selection_benchmark --log_level=message
+ */
+BOOST_AUTO_TEST_CASE(coin_selection_benchmark)
+{
+    if (!getenv("SALVAGE_BENCHMARK"))
+        return;
+
+    const int nCoins = 20000;
+    const char* vName[] = {"payouts", "deposits", "dust"};
+    const CAmount vTarget[] = {150 * COIN + 3 * CENT, 1234 * COIN + 5678, 10 * COIN + 1};
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
+    vector<char> vfBest;
+    CAmount nBest;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int nCase = 0; nCase < 3; nCase++) {
+        empty_wallet();
+        for (int i = 0; i < nCoins; i++) {
+            if (nCase == 0) // pool payouts: coins of a few nearby values, the target can be paid exactly
+                add_coin(10 * CENT + (i % 7) * CENT);
+            else if (nCase == 1) // exchange deposits: amounts spread over four orders of magnitude
+                add_coin((insecure_rand() % 10000 + 1) * (insecure_rand() % 4 == 0 ? COIN : CENT) + insecure_rand() % CENT);
+            else // mostly dust with a few large coins
+                add_coin(i % 100 == 0 ? (insecure_rand() % 1000 + 1) * COIN : insecure_rand() % CENT + 1);
+        }
+
+        int64_t nStart = GetTimeMicros();
+        BOOST_CHECK(wallet.SelectCoinsMinConf(vTarget[nCase], 1, 6, vCoins, setCoinsRet, nValueRet));
+        int64_t nSelect = GetTimeMicros() - nStart;
+
+        // the knapsack as it ran before, on the coins below the target plus a cent
+        get_values(vValue);
+        CAmount nTotalLower = 0;
+        vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vLower;
+        BOOST_FOREACH(const PAIRTYPE(CAmount, PAIRTYPE(const CWalletTx*, unsigned int))& value, vValue) {
+            if (value.first < vTarget[nCase] + CENT) {
+                vLower.push_back(value);
+                nTotalLower += value.first;
+            }
+        }
+        nStart = GetTimeMicros();
+        if (nTotalLower > vTarget[nCase])
+            ApproximateBestSubset(vLower, nTotalLower, vTarget[nCase], vfBest, nBest, 1000, 0);
+        else
+            nBest = 0;
+        int64_t nKnapsack = GetTimeMicros() - nStart;
+
+        BOOST_TEST_MESSAGE(strprintf("%s among %d coins: selection %.2fms overpays %s, knapsack %.2fms overpays %s",
+            vName[nCase], nCoins, nSelect * 0.001, FormatMoney(nValueRet - vTarget[nCase]),
+            nKnapsack * 0.001, nBest ? FormatMoney(nBest - vTarget[nCase]) : "-"));
+    }
+
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(balances_instantx_lock)
+{
+    CWallet keystore;
+    CKey key;
+    key.MakeNewKey(true);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = COIN;
+    mtx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CTransaction tx(mtx);
+    uint256 hash = tx.GetHash();
+
+    // the running totals themselves are tested, not a full scan
+    bool fCheckWalletBalancesSaved = fCheckWalletBalances;
+    fCheckWalletBalances = false;
+
+    LOCK2(cs_main, keystore.cs_wallet);
+    keystore.AddKeyPubKey(key, key.GetPubKey());
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 0, GetTime(), 0.0, chainActive.Height()));
+    {
+        LOCK(cs_instantx);
+        CTransactionLock lock;
+        lock.nBlockHeight = chainActive.Height() + 1;
+        lock.txHash = hash;
+        lock.nExpiration = GetTime() + 60 * 60;
+        lock.nTimeout = GetTime() + 5 * 60;
+        for (int i = 0; i < INSTANTX_SIGNATURES_REQUIRED; i++) {
+            CConsensusVote vote;
+            vote.txHash = hash;
+            vote.nBlockHeight = lock.nBlockHeight;
+            lock.vecConsensusVotes.push_back(vote);
+        }
+        mapTxLocks[hash] = lock;
+    }
+    keystore.AddToWallet(CWalletTx(&keystore, tx));
+
+    // a complete lock makes the unconfirmed transaction trusted
+    BOOST_CHECK_EQUAL(keystore.GetBalance(), COIN);
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), 0);
+
+    // once the lock is gone the transaction is unconfirmed again
+    {
+        LOCK(cs_instantx);
+        mapTxLocks.erase(hash);
+    }
+    BOOST_CHECK_EQUAL(keystore.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), COIN);
+
+    // and once it leaves the mempool it counts for nothing
+    std::list<CTransaction> removed;
+    mempool.remove(tx, removed);
+    BOOST_CHECK_EQUAL(keystore.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(keystore.GetUnconfirmedBalance(), 0);
+
+    fCheckWalletBalances = fCheckWalletBalancesSaved;
+}
+
+BOOST_AUTO_TEST_CASE(scan_filter)
+{
+    CWallet keystore;
+    CKey key, keyOther, keyWatch;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    keyWatch.MakeNewKey(true);
+
+    vector<CPubKey> vMultisig;
+    vMultisig.push_back(key.GetPubKey());
+    vMultisig.push_back(keyOther.GetPubKey());
+    CScript scriptMultisig = GetScriptForMultisig(1, vMultisig);
+    CScript scriptWatch = GetScriptForDestination(keyWatch.GetPubKey().GetID());
+
+    {
+        LOCK(keystore.cs_wallet);
+        keystore.AddKeyPubKey(key, key.GetPubKey());
+        keystore.AddCScript(scriptMultisig);
+        keystore.AddWatchOnly(scriptWatch);
+    }
+    CWalletScanFilter filter = keystore.GetScanFilter();
+
+    vector<CScript> vScripts;
+    vScripts.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+    vScripts.push_back(CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG);
+    vScripts.push_back(GetScriptForDestination(CScriptID(scriptMultisig)));
+    vScripts.push_back(scriptMultisig);
+    vScripts.push_back(scriptWatch);
+    vScripts.push_back(GetScriptForDestination(keyOther.GetPubKey().GetID()));
+    vScripts.push_back(CScript() << ToByteVector(keyWatch.GetPubKey()) << OP_CHECKSIG);
+    vScripts.push_back(CScript() << OP_RETURN);
+
+    // everything IsMine accepts passes the filter; partly owned multisig passes as well
+    for (unsigned int i = 0; i < vScripts.size(); i++) {
+        BOOST_CHECK_EQUAL(filter.IsRelevant(vScripts[i]), i < 5);
+        if (::IsMine(keystore, vScripts[i]) != ISMINE_NO)
+            BOOST_CHECK(filter.IsRelevant(vScripts[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ismine_known_scripts)
+{
+    CBasicKeyStore keystore;
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKeyHash = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    // the same key hash pushed with OP_PUSHDATA1, which Solver() accepts as well
+    CScript scriptPushData = CScript() << OP_DUP << OP_HASH160 << OP_PUSHDATA1;
+    scriptPushData.push_back(20);
+    scriptPushData.insert(scriptPushData.end(), scriptPubKeyHash.begin() + 3, scriptPubKeyHash.begin() + 23);
+    scriptPushData << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    BOOST_CHECK(!keystore.HaveKnownScript(scriptPubKeyHash));
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptPubKeyHash), ISMINE_NO);
+
+    keystore.AddKey(key);
+    BOOST_CHECK(keystore.HaveKnownScript(scriptPubKeyHash));
+    BOOST_CHECK(keystore.HaveKnownScript(scriptPubKey));
+    BOOST_CHECK(!keystore.HaveKnownScript(scriptPushData));
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptPubKeyHash), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptPubKey), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptPushData), ISMINE_SPENDABLE);
+
+    CScript scriptRedeem = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptHash = GetScriptForDestination(CScriptID(scriptRedeem));
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptHash), ISMINE_NO);
+    keystore.AddCScript(scriptRedeem);
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptHash), ISMINE_SPENDABLE);
+
+    CKey keyWatch;
+    keyWatch.MakeNewKey(false);
+    CScript scriptWatch = GetScriptForDestination(keyWatch.GetPubKey().GetID());
+    BOOST_CHECK_EQUAL(IsMine(keystore, scriptWatch), ISMINE_NO);
+    keystore.AddWatchOnly(scriptWatch);
+    BOOST_CHECK(IsMine(keystore, scriptWatch) & ISMINE_WATCH_ONLY);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -40,6 +40,8 @@ unsigned int nTxConfirmTarget = 1;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
 bool fPayAtLeastCustomFee = true;
+bool fCheckWalletBalances = false;
+int nRescanThreads = 1;
 
 /**
  * Fees smaller than this (in duffs) are considered zero fee (for transaction creation)
@@ -54,11 +56,11 @@ CFeeRate CWallet::minTxFee = CFeeRate(10000);
  * @{
  */
 
-struct CompareValueOnly {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-        const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
+struct CompareCandidateValue {
+    bool operator()(const CCoinSelectionPool::CCandidate& t1,
+        const CCoinSelectionPool::CCandidate& t2) const
     {
-        return t1.first < t2.first;
+        return t1.nValue > t2.nValue;
     }
 };
 
@@ -622,6 +624,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH (PAIRTYPE(const uint256, CWalletTx) & item, mapWallet)
             item.second.MarkDirty();
+        fBalancesValid = false;
+        fWalletCoinsIndexed = false;
     }
 }
 
@@ -633,6 +637,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        fWalletCoinsIndexed = false;
+        fBalancesValid = false;
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -683,6 +689,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                         wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            InvalidateDarksendRounds(hash);
         }
 
         bool fUpdated = false;
@@ -713,6 +720,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        setBalancesDirty.insert(hash);
+        AddToWalletCoins(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -760,8 +769,10 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // available of the outputs it spends. So force those to be
     // recomputed, also:
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        if (mapWallet.count(txin.prevout.hash))
+        if (mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            setBalancesDirty.insert(txin.prevout.hash);
+        }
     }
 }
 
@@ -771,6 +782,13 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
+        InvalidateDarksendRounds(hash);
+        setBalancesDirty.insert(hash);
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            for (unsigned int i = 0; i < it->second.vout.size(); i++)
+                EraseFromWalletCoins(COutPoint(hash, i));
+        }
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -807,11 +825,39 @@ CAmount CWallet::GetDebit(const CTxIn& txin, const isminefilter& filter) const
     return 0;
 }
 
+int CWallet::CacheDarksendRounds(const COutPoint& outpoint, int nRounds) const
+{
+    // a full cache is rebuilt on demand, that is cheaper than tracking which entries are used
+    if (mapOutpointRounds.size() >= MAX_DARKSEND_ROUNDS_CACHE)
+        mapOutpointRounds.clear();
+
+    mapOutpointRounds[outpoint] = nRounds;
+    LogPrint("Darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", outpoint.hash.ToString(), outpoint.n, nRounds);
+    return nRounds;
+}
+
+void CWallet::InvalidateDarksendRounds(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    if (mapOutpointRounds.empty()) return;
+
+    // rounds of the transactions spending this one were counted without it
+    const CWalletTx* wtx = GetWalletTx(hash);
+    if (wtx == NULL) return;
+
+    bool fSpent = false;
+    for (unsigned int i = 0; i < wtx->vout.size() && !fSpent; i++)
+        fSpent = mapTxSpends.count(COutPoint(hash, i)) != 0;
+
+    if (fSpent) {
+        LogPrint("Darksend", "InvalidateDarksendRounds - %s changes known chains, forgetting %d outpoints\n", hash.ToString(), mapOutpointRounds.size());
+        mapOutpointRounds.clear();
+    }
+}
+
 // Recursively determine the rounds of a given input (How deep is the Darksend chain for a given input)
 int CWallet::GetRealInputDarksendRounds(CTxIn in, int rounds) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
-
     if (rounds >= 16) return 15; // 16 rounds max
 
     uint256 hash = in.prevout.hash;
@@ -819,17 +865,10 @@ int CWallet::GetRealInputDarksendRounds(CTxIn in, int rounds) const
 
     const CWalletTx* wtx = GetWalletTx(hash);
     if (wtx != NULL) {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if (mdwi == mDenomWtxes.end()) {
-            LogPrint("Darksend", "GetInputDarksendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        }
-        // found and it's not an initial value, just return it
-        else if (mDenomWtxes[hash].vout[nout].nRounds != -10) {
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
-
+        // already known, just return it
+        std::map<COutPoint, int>::const_iterator mi = mapOutpointRounds.find(in.prevout);
+        if (mi != mapOutpointRounds.end())
+            return mi->second;
 
         // bounds check
         if (nout >= wtx->vout.size()) {
@@ -838,30 +877,20 @@ int CWallet::GetRealInputDarksendRounds(CTxIn in, int rounds) const
             return -4;
         }
 
-        if (pwalletMain->IsCollateralAmount(wtx->vout[nout].nValue)) {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("Darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+        if (pwalletMain->IsCollateralAmount(wtx->vout[nout].nValue))
+            return CacheDarksendRounds(in.prevout, -3);
 
         //make sure the final output is non-denominate
         if (/*rounds == 0 && */ !IsDenominatedAmount(wtx->vout[nout].nValue)) //NOT DENOM
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("Darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+            return CacheDarksendRounds(in.prevout, -2);
 
         bool fAllDenoms = true;
         BOOST_FOREACH (CTxOut out, wtx->vout) {
             fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
         }
         // this one is denominated but there is another non-denominated output found in the same tx
-        if (!fAllDenoms) {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("Darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+        if (!fAllDenoms)
+            return CacheDarksendRounds(in.prevout, 0);
 
         int nShortest = -10; // an initial value, should be no way to get this by calculations
         bool fDenomFound = false;
@@ -876,11 +905,9 @@ int CWallet::GetRealInputDarksendRounds(CTxIn in, int rounds) const
                 }
             }
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
-                                                             :
-                                                             0; // too bad, we are the fist one in that chain
-        LogPrint("Darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
+        return CacheDarksendRounds(in.prevout, fDenomFound ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
+                                                           :
+                                                           0); // too bad, we are the fist one in that chain
     }
 
     return rounds - 1;
@@ -1078,14 +1105,183 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+bool CWalletScanFilter::IsRelevant(const CScript& scriptPubKey) const
+{
+    if (setScripts.count(scriptPubKey))
+        return true;
+
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType) {
+    case TX_PUBKEY:
+        return setKeyIDs.count(CPubKey(vSolutions[0]).GetID());
+    case TX_PUBKEYHASH:
+        return setKeyIDs.count(CKeyID(uint160(vSolutions[0])));
+    case TX_SCRIPTHASH:
+        return setScriptIDs.count(CScriptID(uint160(vSolutions[0])));
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (setKeyIDs.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScanFilter::IsRelevant(const CTransaction& tx) const
+{
+    BOOST_FOREACH (const CTxOut& txout, tx.vout)
+        if (IsRelevant(txout.scriptPubKey))
+            return true;
+    return false;
+}
+
+CWalletScanFilter CWallet::GetScanFilter() const
+{
+    CWalletScanFilter filter;
+    LOCK(cs_KeyStore);
+    GetKeys(filter.setKeyIDs);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        filter.setScriptIDs.insert(it->first);
+    filter.setScripts = setWatchOnly;
+    return filter;
+}
+
+namespace
+{
+/** A block read for a rescan, with the transactions whose outputs passed the filter */
+struct CRescanBlock {
+    CBlock block;
+    std::vector<bool> vMatch;
+};
+
+/**
+ * Reads the blocks of a rescan on a group of threads and filters their outputs.
+ *
+ * The blocks are handed out in chain order and the readers stay at most
+ * RESCAN_READ_AHEAD blocks ahead of the wallet, which takes them back in order.
+ * Readers only touch the block files and the filter, so the wallet can keep
+ * cs_main and cs_wallet for the whole rescan.
+ */
+class CRescanReader
+{
+private:
+    boost::mutex mutex;
+    //! Readers block on this when they are too far ahead
+    boost::condition_variable condReader;
+    //! The wallet blocks on this while the next block is being read
+    boost::condition_variable condWallet;
+
+    const std::vector<CBlockIndex*>& vBlocks;
+    const CWalletScanFilter& filter;
+    //! Next block to hand to a reader
+    size_t nNext;
+    //! Blocks taken back by the wallet
+    size_t nTaken;
+    bool fStop;
+    //! Reader threads that have not exited yet
+    int nReaders;
+    std::map<size_t, boost::shared_ptr<CRescanBlock> > mapRead;
+
+    void ReadBlocks()
+    {
+        while (true) {
+            size_t nBlock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNext < vBlocks.size() && nNext >= nTaken + RESCAN_READ_AHEAD)
+                    condReader.wait(lock);
+                if (fStop || nNext >= vBlocks.size())
+                    return;
+                nBlock = nNext++;
+            }
+
+            boost::shared_ptr<CRescanBlock> pread(new CRescanBlock());
+            try {
+                // a block that cannot be read is scanned as empty, as it always was
+                if (!ReadBlockFromDisk(pread->block, vBlocks[nBlock]))
+                    pread->block.SetNull();
+                pread->vMatch.resize(pread->block.vtx.size());
+                for (unsigned int i = 0; i < pread->block.vtx.size(); i++)
+                    pread->vMatch[i] = filter.IsRelevant(pread->block.vtx[i]);
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "CRescanReader::Thread()");
+                pread.reset(new CRescanBlock());
+            } catch (...) {
+                PrintExceptionContinue(NULL, "CRescanReader::Thread()");
+                pread.reset(new CRescanBlock());
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapRead[nBlock] = pread;
+            condWallet.notify_all();
+        }
+    }
+
+public:
+    CRescanReader(const std::vector<CBlockIndex*>& vBlocksIn, const CWalletScanFilter& filterIn, int nReadersIn) : vBlocks(vBlocksIn), filter(filterIn), nNext(0), nTaken(0), fStop(false), nReaders(nReadersIn) {}
+
+    void Thread()
+    {
+        try {
+            ReadBlocks();
+        } catch (...) {
+            PrintExceptionContinue(NULL, "CRescanReader::Thread()");
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nReaders--;
+        condWallet.notify_all();
+    }
+
+    //! Wait for block nBlock, blocks must be taken in order
+    boost::shared_ptr<CRescanBlock> Take(size_t nBlock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<size_t, boost::shared_ptr<CRescanBlock> >::iterator it;
+        while ((it = mapRead.find(nBlock)) == mapRead.end()) {
+            // a block handed out is always posted, so this only happens if the readers died
+            if (nReaders == 0)
+                throw std::runtime_error("CRescanReader::Take() : all readers exited before reading the block");
+            condWallet.wait(lock);
+        }
+        boost::shared_ptr<CRescanBlock> pread = it->second;
+        mapRead.erase(it);
+        nTaken = nBlock + 1;
+        condReader.notify_all();
+        return pread;
+    }
+
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condReader.notify_all();
+    }
+};
+
+void ThreadRescanReader(CRescanReader* preader)
+{
+    RenameThread("salvage-rescan");
+    preader->Thread();
+}
+}
+
 /**
- * Scan the block chain (starting in pindexStart) for transactions
- * from or to us. If fUpdate is true, found transactions that already
- * exist in the wallet will be updated.
+ * Scan the chain from pindexStart for transactions involving the wallet and add them.
+ *
+ * Blocks are read and their outputs matched against GetScanFilter() by nRescanThreads
+ * readers. Transactions are then applied in chain order, so a spend is recognised by the
+ * wallet transaction its input refers to, which may have been found earlier in the scan.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64_t nStart = GetTimeMillis();
     int64_t nNow = GetTime();
 
     CBlockIndex* pindex = pindexStart;
@@ -1097,26 +1293,56 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        std::vector<CBlockIndex*> vBlocks;
+        for (CBlockIndex* pindexScan = pindex; pindexScan; pindexScan = chainActive.Next(pindexScan))
+            vBlocks.push_back(pindexScan);
+
+        CWalletScanFilter filter = GetScanFilter();
+        int nThreads = std::max(1, std::min(nRescanThreads, (int)vBlocks.size()));
+        CRescanReader reader(vBlocks, filter, nThreads);
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadRescanReader, &reader));
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex) {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+        try {
+            for (size_t nBlock = 0; nBlock < vBlocks.size(); nBlock++) {
+                pindex = vBlocks[nBlock];
+                double dProgress = dProgressTip - dProgressStart > 0.0 ? (Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) : 0.0;
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)(dProgress * 100))));
+
+                boost::shared_ptr<CRescanBlock> pread = reader.Take(nBlock);
+                const CBlock& block = pread->block;
+                for (unsigned int i = 0; i < block.vtx.size(); i++) {
+                    const CTransaction& tx = block.vtx[i];
+                    // the filter only looks at outputs, spends are found through the wallet itself
+                    bool fCandidate = pread->vMatch[i] || mapWallet.count(tx.GetHash());
+                    for (unsigned int j = 0; !fCandidate && j < tx.vin.size(); j++)
+                        fCandidate = mapWallet.count(tx.vin[j].prevout.hash);
+                    if (fCandidate && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                        ret++;
+                }
+
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    int64_t nETA = dProgress > 0.0 ? (int64_t)((GetTimeMillis() - nStart) * (1.0 - dProgress) / dProgress / 1000) : 0;
+                    LogPrintf("Still rescanning. At block %d. Progress=%f, %u blocks left, ETA %ds\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex), vBlocks.size() - nBlock - 1, nETA);
+                }
             }
+        } catch (...) {
+            // the readers refer to vBlocks and the filter on this stack
+            reader.Stop();
+            threadGroup.join_all();
+            throw;
         }
+        reader.Stop();
+        threadGroup.join_all();
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        LogPrintf("Rescanned %u blocks with %d threads, %d wallet transactions found  %dms\n", vBlocks.size(), nThreads, ret, GetTimeMillis() - nStart);
     }
     return ret;
 }
@@ -1156,7 +1382,11 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if (strCommand == "ix") {
-                mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                {
+                    LOCK(cs_instantx);
+                    mapTxLockReq.insert(make_pair(hash, (CTransaction) * this));
+                }
+                instantXLocks.RequestReceived(hash);
                 CreateNewLock(((CTransaction) * this));
                 RelayTransactionLockReq((CTransaction) * this, true);
             } else {
@@ -1222,19 +1452,111 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+std::string CWalletBalances::ToString() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    return strprintf("balance=%s unconfirmed=%s immature=%s anonymized=%s watchonly=%s/%s/%s",
+        FormatMoney(nBalance), FormatMoney(nUnconfirmed), FormatMoney(nImmature), FormatMoney(nAnonymized),
+        FormatMoney(nWatchOnly), FormatMoney(nUnconfirmedWatchOnly), FormatMoney(nImmatureWatchOnly));
+}
+
+CWalletBalances CWallet::GetTxBalances(const CWalletTx& wtx, bool& fPending) const
+{
+    CWalletBalances balances;
+
+    bool fFinal = IsFinalTx(wtx);
+    int nDepth = wtx.GetDepthInMainChain();
+    if (wtx.IsTrusted()) {
+        balances.nBalance = wtx.GetAvailableCredit();
+        balances.nWatchOnly = wtx.GetAvailableWatchOnlyCredit();
+        if (!fLiteMode) balances.nAnonymized = wtx.GetAnonymizedCredit();
+    } else if (!fFinal || nDepth == 0) {
+        balances.nUnconfirmed = wtx.GetAvailableCredit();
+        balances.nUnconfirmedWatchOnly = wtx.GetAvailableWatchOnlyCredit();
+    }
+    balances.nImmature = wtx.GetImmatureCredit();
+    balances.nImmatureWatchOnly = wtx.GetImmatureWatchOnlyCredit();
+
+    // an InstantX lock can expire or be cancelled, and the transaction can drop out of the mempool,
+    // without the wallet noticing, so anything not in a block is looked at again on every query
+    int nChainDepth = wtx.GetDepthInMainChain(false);
+    fPending = !fFinal || nChainDepth <= 0 || ((wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0);
+
+    return balances;
+}
+
+void CWallet::UpdateTxBalances(const uint256& hash) const
+{
+    map<uint256, CWalletBalances>::iterator it = mapTxBalances.find(hash);
+    if (it != mapTxBalances.end()) {
+        balancesTotal -= it->second;
+        mapTxBalances.erase(it);
+    }
+    setBalancesPending.erase(hash);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end()) return;
+
+    bool fPending = false;
+    CWalletBalances balances = GetTxBalances(mi->second, fPending);
+    if (fPending) setBalancesPending.insert(hash);
+    if (balances.IsNull()) return;
+
+    balancesTotal += balances;
+    mapTxBalances.insert(make_pair(hash, balances));
+}
+
+CWalletBalances CWallet::ScanBalances() const
+{
+    CWalletBalances balances;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
+        bool fPending;
+        balances += GetTxBalances(it->second, fPending);
+    }
+    return balances;
+}
+
+const CWalletBalances& CWallet::GetBalances() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // a reorg can change the depth of any transaction
+    if (fBalancesValid && pindexBalances && !chainActive.Contains(pindexBalances))
+        fBalancesValid = false;
+
+    if (!fBalancesValid) {
+        balancesTotal.SetNull();
+        mapTxBalances.clear();
+        setBalancesPending.clear();
+        setBalancesDirty.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateTxBalances(it->first);
+        fBalancesValid = true;
+        LogPrint("wallet", "CWallet::GetBalances() : %d of %d transactions add to the balances, %d pending\n", mapTxBalances.size(), mapWallet.size(), setBalancesPending.size());
+    } else {
+        setBalancesDirty.insert(setBalancesPending.begin(), setBalancesPending.end());
+        BOOST_FOREACH (const uint256& hash, setBalancesDirty)
+            UpdateTxBalances(hash);
+        setBalancesDirty.clear();
+    }
+    pindexBalances = chainActive.Tip();
+
+    if (fCheckWalletBalances) {
+        CWalletBalances balancesScan = ScanBalances();
+        if (!(balancesScan == balancesTotal)) {
+            LogPrintf("CWallet::GetBalances() : running totals %s do not match a full scan %s\n", balancesTotal.ToString(), balancesScan.ToString());
+            fBalancesValid = false;
+            return GetBalances();
         }
     }
 
-    return nTotal;
+    return balancesTotal;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nBalance;
 }
 
 CAmount CWallet::GetAnonymizableBalance() const
@@ -1259,18 +1581,8 @@ CAmount CWallet::GetAnonymizedBalance() const
 {
     if (fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
@@ -1355,71 +1667,175 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
+}
+
+CAmount CWallet::GetWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnly;
+}
+
+CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmedWatchOnly;
+}
+
+CAmount CWallet::GetImmatureWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmatureWatchOnly;
+}
+
+/**
+ * Add the outputs of wtx that are ours and not spent deep in the chain to the coin index,
+ * or move outputs already in it to the height of the block wtx is now in.
+ */
+void CWallet::AddToWalletCoins(const CWalletTx& wtx) const
+{
+    // the first listing indexes everything
+    if (!fWalletCoinsIndexed) return;
+
+    const uint256& hash = wtx.GetHash();
+    int nHeight = INT_MAX;
+    if (wtx.hashBlock != 0) {
+        BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && mi->second)
+            nHeight = mi->second->nHeight;
+    }
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CTxOut& txout = wtx.vout[i];
+        COutPoint outpoint(hash, i);
+
+        std::map<COutPoint, CWalletCoin>::iterator it = mapWalletCoins.find(outpoint);
+        if (it != mapWalletCoins.end()) {
+            // (re)confirmed in another block
+            if (it->second.nHeight != nHeight) {
+                setWalletCoinsByHeight.erase(make_pair(it->second.nHeight, outpoint));
+                it->second.nHeight = nHeight;
+                setWalletCoinsByHeight.insert(make_pair(nHeight, outpoint));
+            }
+            continue;
         }
+
+        // rescans add old history, keep to what may still be spent
+        if (IsMine(txout) == ISMINE_NO || IsSpentDeep(outpoint)) continue;
+
+        CWalletCoin coin;
+        coin.nValue = txout.nValue;
+        coin.nHeight = nHeight;
+        coin.fDestination = ExtractDestination(txout.scriptPubKey, coin.destination);
+        mapWalletCoins.insert(make_pair(outpoint, coin));
+        setWalletCoinsByAmount.insert(make_pair(coin.nValue, outpoint));
+        setWalletCoinsByHeight.insert(make_pair(coin.nHeight, outpoint));
+        if (coin.fDestination)
+            mapWalletCoinsByDestination[coin.destination].insert(outpoint);
     }
-    return nTotal;
 }
 
-CAmount CWallet::GetWatchOnlyBalance() const
+void CWallet::EraseFromWalletCoins(const COutPoint& outpoint) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+    std::map<COutPoint, CWalletCoin>::iterator it = mapWalletCoins.find(outpoint);
+    if (it == mapWalletCoins.end()) return;
+
+    const CWalletCoin& coin = it->second;
+    setWalletCoinsByAmount.erase(make_pair(coin.nValue, outpoint));
+    setWalletCoinsByHeight.erase(make_pair(coin.nHeight, outpoint));
+    if (coin.fDestination) {
+        std::map<CTxDestination, std::set<COutPoint> >::iterator itDest = mapWalletCoinsByDestination.find(coin.destination);
+        if (itDest != mapWalletCoinsByDestination.end()) {
+            itDest->second.erase(outpoint);
+            if (itDest->second.empty())
+                mapWalletCoinsByDestination.erase(itDest);
         }
     }
+    mapWalletCoins.erase(it);
+}
 
-    return nTotal;
+void CWallet::SyncWalletCoins() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // outputs are only dropped once spent WALLET_COINS_PRUNE_DEPTH deep, so shallower reorgs
+    // leave the index complete; heights above the fork are updated as transactions confirm again
+    if (fWalletCoinsIndexed && pindexWalletCoins && !chainActive.Contains(pindexWalletCoins)) {
+        const CBlockIndex* pindexFork = chainActive.FindFork(pindexWalletCoins);
+        if (!pindexFork || pindexWalletCoins->nHeight - pindexFork->nHeight >= WALLET_COINS_PRUNE_DEPTH)
+            fWalletCoinsIndexed = false;
+    }
+
+    if (!fWalletCoinsIndexed) {
+        mapWalletCoins.clear();
+        setWalletCoinsByAmount.clear();
+        setWalletCoinsByHeight.clear();
+        mapWalletCoinsByDestination.clear();
+        fWalletCoinsIndexed = true;
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            AddToWalletCoins(it->second);
+        LogPrint("wallet", "CWallet::SyncWalletCoins() : indexed %d outputs of %d transactions\n", mapWalletCoins.size(), mapWallet.size());
+    }
+
+    pindexWalletCoins = chainActive.Tip();
 }
 
-CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
+bool CWallet::IsSpentDeep(const COutPoint& outpoint) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(outpoint);
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it) {
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() >= WALLET_COINS_PRUNE_DEPTH)
+            return true;
     }
-    return nTotal;
+    return false;
 }
 
-CAmount CWallet::GetImmatureWatchOnlyBalance() const
+bool CWallet::GetAvailableCoin(const COutPoint& outpoint, bool fOnlyConfirmed, bool fUseIX, const CWalletTx*& pcoin, int& nDepth, isminetype& mine, vector<COutPoint>& vPrune) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi == mapWallet.end() || outpoint.n >= mi->second.vout.size()) {
+        vPrune.push_back(outpoint);
+        return false;
     }
-    return nTotal;
+    pcoin = &mi->second;
+
+    if (IsSpent(outpoint.hash, outpoint.n)) {
+        // forget outputs whose spend can no longer be reorganized away
+        if (IsSpentDeep(outpoint))
+            vPrune.push_back(outpoint);
+        return false;
+    }
+
+    if (!CheckFinalTx(*pcoin))
+        return false;
+
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return false;
+
+    if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    nDepth = pcoin->GetDepthInMainChain(false);
+    // do not use IX for inputs that have less then 6 blockchain confirmations
+    if (fUseIX && nDepth < 6)
+        return false;
+
+    // We should not consider coins which aren't at least in our mempool
+    // It's possible for these to be conflicted via ancestors which we may never be able to detect
+    if (nDepth == 0 && !pcoin->InMempool())
+        return false;
+
+    mine = IsMine(pcoin->vout[outpoint.n]);
+    return mine != ISMINE_NO;
 }
 
 /**
@@ -1431,80 +1847,139 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        SyncWalletCoins();
+
+        vector<COutPoint> vOutpoints;
+        if (nCoinType == ONLY_10000) {
+            CAmount nCollateral = ActiveCollateral() * COIN;
+            std::set<std::pair<CAmount, COutPoint> >::const_iterator it = setWalletCoinsByAmount.lower_bound(make_pair(nCollateral, COutPoint(0, 0)));
+            for (; it != setWalletCoinsByAmount.end() && it->first == nCollateral; ++it)
+                vOutpoints.push_back(it->second);
+        } else if (fUseIX) {
+            int nMaxHeight = chainActive.Height() - 5;
+            std::set<std::pair<int, COutPoint> >::const_iterator it = setWalletCoinsByHeight.begin();
+            for (; it != setWalletCoinsByHeight.end() && it->first <= nMaxHeight; ++it)
+                vOutpoints.push_back(it->second);
+            sort(vOutpoints.begin(), vOutpoints.end());
+        } else {
+            vOutpoints.reserve(mapWalletCoins.size());
+            for (std::map<COutPoint, CWalletCoin>::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
+                vOutpoints.push_back(it->first);
+        }
 
-            if (!CheckFinalTx(*pcoin))
+        vector<COutPoint> vPrune;
+        BOOST_FOREACH (const COutPoint& outpoint, vOutpoints) {
+            const CWalletTx* pcoin;
+            int nDepth;
+            isminetype mine;
+            if (!GetAvailableCoin(outpoint, fOnlyConfirmed, fUseIX, pcoin, nDepth, mine, vPrune))
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+            const CTxOut& txout = pcoin->vout[outpoint.n];
+            bool found = false;
+            if (nCoinType == ONLY_DENOMINATED) {
+                found = IsDenominatedAmount(txout.nValue);
+            } else if (nCoinType == ONLY_NOT10000IFMN) {
+                found = !(fMasterNode && txout.nValue == ActiveCollateral() * COIN);
+            } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
+                if (IsCollateralAmount(txout.nValue)) continue; // do not use collateral amounts
+                found = !IsDenominatedAmount(txout.nValue);
+                if (found && fMasterNode) found = txout.nValue != ActiveCollateral() * COIN; // do not use Hot MN funds
+            } else if (nCoinType == ONLY_10000) {
+                found = txout.nValue == ActiveCollateral() * COIN;
+            } else {
+                found = true;
+            }
+            if (!found) continue;
+
+            if ((!IsLockedCoin(outpoint.hash, outpoint.n) || nCoinType == ONLY_10000) &&
+                (txout.nValue > 0 || fIncludeZeroValue) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(outpoint.hash, outpoint.n)))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth,
+                    ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
+                        (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO)));
+        }
 
-            if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        BOOST_FOREACH (const COutPoint& outpoint, vPrune)
+            EraseFromWalletCoins(outpoint);
+    }
+}
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (fUseIX && nDepth < 6)
-                continue;
+// AvailableCoins(ONLY_DENOMINATED) or the collateral outputs of AvailableCoins, from the amount index
+void CWallet::AvailableDenominatedCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, bool fCollateral, CAmount nAmount) const
+{
+    vCoins.clear();
 
-            // We should not consider coins which aren't at least in our mempool
-            // It's possible for these to be conflicted via ancestors which we may never be able to detect
-            if (nDepth == 0 && !pcoin->InMempool())
+    LOCK2(cs_main, cs_wallet);
+    SyncWalletCoins();
+
+    // ranges of amounts to look at, lowest first
+    vector<pair<CAmount, CAmount> > vRanges;
+    if (nAmount)
+        vRanges.push_back(make_pair(nAmount, nAmount));
+    else if (fCollateral)
+        vRanges.push_back(make_pair(DARKSEND_COLLATERAL + 1, DARKSEND_COLLATERAL * 5 - 1));
+    else
+        BOOST_FOREACH (int64_t d, DarKsendDenominations)
+            vRanges.push_back(make_pair(d, d));
+    sort(vRanges.begin(), vRanges.end());
+
+    vector<COutPoint> vPrune;
+    for (unsigned int i = 0; i < vRanges.size(); i++) {
+        std::set<std::pair<CAmount, COutPoint> >::const_iterator it = setWalletCoinsByAmount.lower_bound(make_pair(vRanges[i].first, COutPoint(0, 0)));
+        for (; it != setWalletCoinsByAmount.end() && it->first <= vRanges[i].second; ++it) {
+            if (fCollateral ? !IsCollateralAmount(it->first) : !IsDenominatedAmount(it->first)) continue;
+
+            const COutPoint& outpoint = it->second;
+            const CWalletTx* pcoin;
+            int nDepth;
+            isminetype mine;
+            if (!GetAvailableCoin(outpoint, fOnlyConfirmed, false, pcoin, nDepth, mine, vPrune))
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if (nCoinType == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if (nCoinType == ONLY_NOT10000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == ActiveCollateral() * COIN);
-                } else if (nCoinType == ONLY_NONDENOMINATED_NOT10000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if (found && fMasterNode) found = pcoin->vout[i].nValue != ActiveCollateral() * COIN; // do not use Hot MN funds
-                } else if (nCoinType == ONLY_10000) {
-                    found = pcoin->vout[i].nValue == ActiveCollateral() * COIN;
-                } else {
-                    found = true;
-                }
-                if (!found) continue;
-
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    (!IsLockedCoin((*it).first, i) || nCoinType == ONLY_10000) &&
-                    (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth,
-                        ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
-                            (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO)));
-            }
+            if (!IsLockedCoin(outpoint.hash, outpoint.n))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
         }
     }
+
+    BOOST_FOREACH (const COutPoint& outpoint, vPrune)
+        EraseFromWalletCoins(outpoint);
 }
 
+// AvailableCoins(fConfirmed) grouped by address, from the destination index
 map<CBitcoinAddress, vector<COutput> > CWallet::AvailableCoinsByAddress(bool fConfirmed, CAmount maxCoinValue)
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, fConfirmed);
-
     map<CBitcoinAddress, vector<COutput> > mapCoins;
-    BOOST_FOREACH (COutput out, vCoins) {
-        if (maxCoinValue > 0 && out.tx->vout[out.i].nValue > maxCoinValue)
-            continue;
 
-        CTxDestination address;
-        if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-            continue;
+    LOCK2(cs_main, cs_wallet);
+    SyncWalletCoins();
+
+    vector<COutPoint> vPrune;
+    std::map<CTxDestination, std::set<COutPoint> >::const_iterator itDest;
+    for (itDest = mapWalletCoinsByDestination.begin(); itDest != mapWalletCoinsByDestination.end(); ++itDest) {
+        BOOST_FOREACH (const COutPoint& outpoint, itDest->second) {
+            const CWalletTx* pcoin;
+            int nDepth;
+            isminetype mine;
+            if (!GetAvailableCoin(outpoint, fConfirmed, false, pcoin, nDepth, mine, vPrune))
+                continue;
+
+            CAmount nValue = pcoin->vout[outpoint.n].nValue;
+            if (nValue <= 0 || (maxCoinValue > 0 && nValue > maxCoinValue))
+                continue;
 
-        mapCoins[CBitcoinAddress(address)].push_back(out);
+            if (!IsLockedCoin(outpoint.hash, outpoint.n))
+                mapCoins[CBitcoinAddress(itDest->first)].push_back(COutput(pcoin, outpoint.n, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+        }
     }
 
+    BOOST_FOREACH (const COutPoint& outpoint, vPrune)
+        EraseFromWalletCoins(outpoint);
+
     return mapCoins;
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
+void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue, vector<char>& vfBest, CAmount& nBest, int iterations = 1000, int64_t nDeadline = 0)
 {
     vector<char> vfIncluded;
 
@@ -1514,6 +1989,10 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     seed_insecure_rand();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++) {
+        // a few iterations always run, so a pass never returns its all-coins start state
+        if (nDeadline && nRep >= COIN_SELECTION_MIN_ITERATIONS && GetTimeMillis() > nDeadline)
+            break;
+
         vfIncluded.assign(vValue.size(), false);
         CAmount nTotal = 0;
         bool fReachedTarget = false;
@@ -1543,22 +2022,76 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     }
 }
 
+// Depth first search for a subset of vValue (largest first) adding up to nTargetValue exactly,
+// so the transaction needs no change. Branches that cannot reach the target with the coins
+// left, or that only swap a coin for an equal one already tried, are skipped. Gives up after
+// nMaxTries steps or once nDeadline (GetTimeMillis) has passed.
+bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > >& vValue, const CAmount& nTargetValue, vector<char>& vfBest, int nMaxTries, int64_t nDeadline)
+{
+    size_t nCoins = vValue.size();
+
+    // vRemaining[i] is the sum of vValue[i..]
+    vector<CAmount> vRemaining(nCoins + 1, 0);
+    for (size_t i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    vector<char> vfIncluded(nCoins, false);
+    vector<size_t> vSelected;
+    CAmount nTotal = 0;
+    size_t i = 0;
+
+    for (int nTries = 0; nTries < nMaxTries; nTries++) {
+        if (nTotal == nTargetValue) {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTries % 1000 == 999 && GetTimeMillis() > nDeadline)
+            return false;
 
-// TODO: find appropriate place for this sort function
-// move denoms down
-bool less_then_denom(const COutput& out1, const COutput& out2)
+        if (nTotal > nTargetValue || i == nCoins || nTotal + vRemaining[i] < nTargetValue) {
+            // take the last coin out again and go on without it
+            if (vSelected.empty())
+                return false;
+            size_t j = vSelected.back();
+            vSelected.pop_back();
+            vfIncluded[j] = false;
+            nTotal -= vValue[j].first;
+            for (i = j + 1; i < nCoins && vValue[i].first == vValue[j].first; i++)
+                ;
+            continue;
+        }
+
+        vfIncluded[i] = true;
+        vSelected.push_back(i);
+        nTotal += vValue[i].first;
+        i++;
+    }
+
+    return false;
+}
+
+CCoinSelectionPool::CCoinSelectionPool(const CWallet& wallet, const vector<COutput>& vCoins)
 {
-    const CWalletTx* pcoin1 = out1.tx;
-    const CWalletTx* pcoin2 = out2.tx;
+    vCandidates.reserve(vCoins.size());
+    BOOST_FOREACH (const COutput& output, vCoins) {
+        if (!output.fSpendable)
+            continue;
 
-    bool found1 = false;
-    bool found2 = false;
-    BOOST_FOREACH (int64_t d, DarKsendDenominations) // loop through predefined denoms
-    {
-        if (pcoin1->vout[out1.i].nValue == d) found1 = true;
-        if (pcoin2->vout[out2.i].nValue == d) found2 = true;
+        CCandidate candidate;
+        candidate.nValue = output.tx->vout[output.i].nValue;
+        candidate.coin = make_pair(output.tx, (unsigned int)output.i);
+        candidate.nDepth = output.nDepth;
+        candidate.fFromMe = output.tx->IsFromMe(ISMINE_ALL);
+        candidate.fDenominated = wallet.IsDenominatedAmount(candidate.nValue);
+        vCandidates.push_back(candidate);
     }
-    return (!found1 && found2);
+
+    // coins of the same value stay in random order
+    random_shuffle(vCandidates.begin(), vCandidates.end(), GetRandInt);
+    stable_sort(vCandidates.begin(), vCandidates.end(), CompareCandidateValue());
 }
 
 bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const
@@ -1606,7 +2139,12 @@ bool CWallet::MintableCoins()
     return false;
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    return SelectCoinsMinConf(nTargetValue, nConfMine, nConfTheirs, CCoinSelectionPool(*this, vCoins), setCoinsRet, nValueRet);
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const CCoinSelectionPool& pool, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -1618,31 +2156,19 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*, unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
-
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++) {
         if (fDebug) LogPrint("selectcoins", "tryDenom: %d\n", tryDenom);
         vValue.clear();
         nTotalLower = 0;
-        BOOST_FOREACH (const COutput& output, vCoins) {
-            if (!output.fSpendable)
-                continue;
-
-            const CWalletTx* pcoin = output.tx;
-
-            //            if (fDebug) LogPrint("selectcoins", "value %s confirms %d\n", FormatMoney(pcoin->vout[output.i].nValue), output.nDepth);
-            if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+        BOOST_FOREACH (const CCoinSelectionPool::CCandidate& candidate, pool.vCandidates) {
+            if (candidate.nDepth < (candidate.fFromMe ? nConfMine : nConfTheirs))
                 continue;
 
-            int i = output.i;
-            CAmount n = pcoin->vout[i].nValue;
-            if (tryDenom == 0 && IsDenominatedAmount(n)) continue; // we don't want denom values on first run
+            CAmount n = candidate.nValue;
+            if (tryDenom == 0 && candidate.fDenominated) continue; // we don't want denom values on first run
 
-            pair<CAmount, pair<const CWalletTx*, unsigned int> > coin = make_pair(n, make_pair(pcoin, i));
+            pair<CAmount, pair<const CWalletTx*, unsigned int> > coin = make_pair(n, candidate.coin);
 
             if (n == nTargetValue) {
                 setCoinsRet.insert(coin.second);
@@ -1683,14 +2209,20 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         break;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    // vValue is ordered largest first like the pool. A subset paying the target exactly needs no
+    // change, otherwise solve subset sum by stochastic approximation
     vector<char> vfBest;
     CAmount nBest;
+    int64_t nDeadline = GetTimeMillis() + COIN_SELECTION_TIME_BUDGET;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest, COIN_SELECTION_BNB_TRIES, nDeadline)) {
+        nBest = nTargetValue;
+    } else {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000, nDeadline);
+        // when out of time, keep the first pass rather than start over aiming for change
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT && GetTimeMillis() <= nDeadline)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000, nDeadline);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1759,9 +2291,10 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    CCoinSelectionPool pool(*this, vCoins);
+    return (SelectCoinsMinConf(nTargetValue, 1, 6, pool, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, 1, 1, pool, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, pool, setCoinsRet, nValueRet)));
 }
 
 struct CompareByPriority {
@@ -1779,7 +2312,7 @@ bool CWallet::SelectCoinsByDenominations(int nDenom, int64_t nValueMin, int64_t
 
     vCoinsRet2.clear();
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, NULL, ONLY_DENOMINATED);
+    AvailableDenominatedCoins(vCoins, true, false);
 
     std::random_shuffle(vCoins.rbegin(), vCoins.rend());
 
@@ -1885,7 +2418,11 @@ bool CWallet::SelectCoinsDark(CAmount nValueMin, CAmount nValueMax, std::vector<
     nValueRet = 0;
 
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl, nDarksendRoundsMin < 0 ? ONLY_NONDENOMINATED_NOT10000IFMN : ONLY_DENOMINATED);
+    // outputs with rounds below zero are not denominated, all others are in the denomination index
+    if (nDarksendRoundsMin < 0)
+        AvailableCoins(vCoins, true, coinControl, false, ONLY_NONDENOMINATED_NOT10000IFMN);
+    else
+        AvailableDenominatedCoins(vCoins, true, false);
 
     set<pair<const CWalletTx*, unsigned int> > setCoinsRet2;
 
@@ -1924,7 +2461,7 @@ bool CWallet::SelectCoinsCollateral(std::vector<CTxIn>& setCoinsRet, int64_t& nV
     vector<COutput> vCoins;
 
     //LogPrintf(" selecting coins for collateral\n");
-    AvailableCoins(vCoins);
+    AvailableDenominatedCoins(vCoins, true, true);
 
     //LogPrintf("found coins %d\n", (int)vCoins.size());
 
@@ -1948,27 +2485,14 @@ bool CWallet::SelectCoinsCollateral(std::vector<CTxIn>& setCoinsRet, int64_t& nV
 
 int CWallet::CountInputsWithAmount(int64_t nInputAmount)
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it) {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()) {
-                int nDepth = pcoin->GetDepthInMainChain(false);
-
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    COutput out = COutput(pcoin, i, nDepth, true);
-                    CTxIn vin = CTxIn(out.tx->GetHash(), out.i);
+    if (!IsDenominatedAmount(nInputAmount)) return 0;
 
-                    if (out.tx->vout[out.i].nValue != nInputAmount) continue;
-                    if (!IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
-                    if (IsSpent(out.tx->GetHash(), i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+    vector<COutput> vCoins;
+    AvailableDenominatedCoins(vCoins, true, false, nInputAmount);
 
-                    nTotal++;
-                }
-            }
-        }
-    }
+    int64_t nTotal = 0;
+    BOOST_FOREACH (const COutput& out, vCoins)
+        if (IsMine(out.tx->vout[out.i]) == ISMINE_SPENDABLE) nTotal++;
 
     return nTotal;
 }
@@ -1976,13 +2500,9 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
 bool CWallet::HasCollateralInputs(bool fOnlyConfirmed) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, fOnlyConfirmed);
-
-    int nFound = 0;
-    BOOST_FOREACH (const COutput& out, vCoins)
-        if (IsCollateralAmount(out.tx->vout[out.i].nValue)) nFound++;
+    AvailableDenominatedCoins(vCoins, fOnlyConfirmed, true);
 
-    return nFound > 0;
+    return !vCoins.empty();
 }
 
 bool CWallet::IsCollateralAmount(int64_t nInputAmount) const
@@ -2523,6 +3043,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std:
 
                 CWalletTx& coin = mapWallet[txin.prevout.hash];
                 coin.BindWallet(this);
+                setBalancesDirty.insert(txin.prevout.hash);
                 NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 updated_hahes.insert(txin.prevout.hash);
             }
@@ -3622,6 +4143,7 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if (!fEnableInstantX) return -1;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return (*i).second.CountSignatures();
@@ -3635,6 +4157,7 @@ bool CMerkleTx::IsTransactionLockTimedOut() const
     if (!fEnableInstantX) return 0;
 
     //compile consessus vote
+    LOCK(cs_instantx);
     std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
     if (i != mapTxLocks.end()) {
         return GetTime() > (*i).second.nTimeout;
@@ -44,6 +44,8 @@ extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
 extern bool fPayAtLeastCustomFee;
+extern bool fCheckWalletBalances;
+extern int nRescanThreads;
 
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
@@ -55,9 +57,26 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Most outpoints whose Darksend rounds are remembered (~80 bytes each)
+static const unsigned int MAX_DARKSEND_ROUNDS_CACHE = 100000;
+//! Depth at which a spent output is dropped from the wallet's coin index
+static const int WALLET_COINS_PRUNE_DEPTH = 10;
+//! Most branches the search for a subset of coins paying the target exactly visits
+static const int COIN_SELECTION_BNB_TRIES = 100000;
+//! Milliseconds coin selection may spend searching subsets of coins, per confirmation tier
+static const int64_t COIN_SELECTION_TIME_BUDGET = 250;
+//! Knapsack iterations each pass runs even when the time budget is used up
+static const int COIN_SELECTION_MIN_ITERATIONS = 10;
+//! -rescanthreads default, 0 = one block reader per core
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads reading blocks during a rescan
+static const int MAX_RESCAN_THREADS = 8;
+//! How many blocks the rescan readers may get ahead of the wallet
+static const unsigned int RESCAN_READ_AHEAD = 128;
 
 class CAccountingEntry;
 class CCoinControl;
+class CCoinSelectionPool;
 class COutput;
 class CReserveKey;
 class CScript;
@@ -91,6 +110,98 @@ struct CompactTallyItem {
     }
 };
 
+/** Wallet balances by category, as the CWallet::Get*Balance functions report them */
+struct CWalletBalances {
+    CAmount nBalance;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nAnonymized;
+    CAmount nWatchOnly;
+    CAmount nUnconfirmedWatchOnly;
+    CAmount nImmatureWatchOnly;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nBalance = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nAnonymized = 0;
+        nWatchOnly = 0;
+        nUnconfirmedWatchOnly = 0;
+        nImmatureWatchOnly = 0;
+    }
+
+    bool IsNull() const
+    {
+        return *this == CWalletBalances();
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nBalance += b.nBalance;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nAnonymized += b.nAnonymized;
+        nWatchOnly += b.nWatchOnly;
+        nUnconfirmedWatchOnly += b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly += b.nImmatureWatchOnly;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nBalance -= b.nBalance;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nAnonymized -= b.nAnonymized;
+        nWatchOnly -= b.nWatchOnly;
+        nUnconfirmedWatchOnly -= b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly -= b.nImmatureWatchOnly;
+        return *this;
+    }
+
+    friend bool operator==(const CWalletBalances& a, const CWalletBalances& b)
+    {
+        return a.nBalance == b.nBalance && a.nUnconfirmed == b.nUnconfirmed && a.nImmature == b.nImmature &&
+               a.nAnonymized == b.nAnonymized && a.nWatchOnly == b.nWatchOnly &&
+               a.nUnconfirmedWatchOnly == b.nUnconfirmedWatchOnly && a.nImmatureWatchOnly == b.nImmatureWatchOnly;
+    }
+
+    std::string ToString() const;
+};
+
+/** Wallet output that may be unspent, as indexed in CWallet::mapWalletCoins */
+struct CWalletCoin {
+    CAmount nValue;
+    //! height of the block holding the transaction when indexed, INT_MAX while unconfirmed
+    int nHeight;
+    //! only valid if fDestination
+    CTxDestination destination;
+    bool fDestination;
+};
+
+/**
+ * Scripts a rescan looks for: the key IDs, script IDs and watch-only scripts of a wallet.
+ * Matches every output IsMine() accepts (and some it does not, such as multisig with
+ * only part of the keys), but needs no locks, so blocks can be filtered in parallel.
+ */
+class CWalletScanFilter
+{
+public:
+    std::set<CKeyID> setKeyIDs;
+    std::set<CScriptID> setScriptIDs;
+    std::set<CScript> setScripts;
+
+    bool IsRelevant(const CScript& scriptPubKey) const;
+    //! Whether any output of tx may be ours
+    bool IsRelevant(const CTransaction& tx) const;
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -162,6 +273,63 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Darksend rounds of the wallet outpoints GetRealInputDarksendRounds was asked about.
+     * Rounds only depend on the wallet transactions in the chain of inputs, so entries stay
+     * valid until a transaction is erased or arrives after the transactions spending it.
+     */
+    mutable std::map<COutPoint, int> mapOutpointRounds;
+    int CacheDarksendRounds(const COutPoint& outpoint, int nRounds) const;
+    void InvalidateDarksendRounds(const uint256& hash);
+
+    /**
+     * Outputs of wallet transactions that are ours and may be unspent, with indexes by amount,
+     * confirmation height and destination, so listing coins goes over the unspent outputs
+     * rather than all of mapWallet. Built on first use and again after a reorg, kept up to
+     * date by AddToWallet (and so SyncTransaction) and EraseFromWallet. Spent outputs are
+     * dropped once the spend is WALLET_COINS_PRUNE_DEPTH deep; until then the listing
+     * functions check IsSpent and the other conditions of AvailableCoins themselves.
+     */
+    mutable std::map<COutPoint, CWalletCoin> mapWalletCoins;
+    mutable std::set<std::pair<CAmount, COutPoint> > setWalletCoinsByAmount;
+    mutable std::set<std::pair<int, COutPoint> > setWalletCoinsByHeight;
+    mutable std::map<CTxDestination, std::set<COutPoint> > mapWalletCoinsByDestination;
+    mutable const CBlockIndex* pindexWalletCoins;
+    mutable bool fWalletCoinsIndexed;
+    void AddToWalletCoins(const CWalletTx& wtx) const;
+    void EraseFromWalletCoins(const COutPoint& outpoint) const;
+    /// Index the wallet on first use and start over after a deep reorg. Requires cs_main and cs_wallet.
+    void SyncWalletCoins() const;
+    /// Whether the output is spent by a wallet transaction WALLET_COINS_PRUNE_DEPTH deep
+    bool IsSpentDeep(const COutPoint& outpoint) const;
+    /**
+     * Whether an indexed output passes the checks AvailableCoins makes on every coin type, that is
+     * everything but the amount, lock and coin control filters. Outputs that can be dropped from
+     * the index are added to vPrune.
+     */
+    bool GetAvailableCoin(const COutPoint& outpoint, bool fOnlyConfirmed, bool fUseIX, const CWalletTx*& pcoin, int& nDepth, isminetype& mine, std::vector<COutPoint>& vPrune) const;
+    void AvailableDenominatedCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed, bool fCollateral, CAmount nAmount = 0) const;
+
+    /**
+     * Running balance totals, so balance queries do not go over all of mapWallet.
+     * Only transactions adding anything to a balance are kept in mapTxBalances. The share of a
+     * transaction is recalculated when the wallet changes it (setBalancesDirty) and, for the few
+     * that are not in a block (even if InstantX locked), immature or not final, on every query
+     * (setBalancesPending), since blocks, the mempool, locks and time change those without the
+     * wallet noticing. A reorg or a wallet wide MarkDirty starts over from a full scan.
+     */
+    mutable CWalletBalances balancesTotal;
+    mutable std::map<uint256, CWalletBalances> mapTxBalances;
+    mutable std::set<uint256> setBalancesPending;
+    mutable std::set<uint256> setBalancesDirty;
+    mutable const CBlockIndex* pindexBalances;
+    mutable bool fBalancesValid;
+    CWalletBalances GetTxBalances(const CWalletTx& wtx, bool& fPending) const;
+    void UpdateTxBalances(const uint256& hash) const;
+    CWalletBalances ScanBalances() const;
+    /// The running totals brought up to date. Requires cs_main and cs_wallet.
+    const CWalletBalances& GetBalances() const;
+
 public:
     bool MintableCoins();
     bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const;
@@ -244,6 +412,10 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        pindexWalletCoins = NULL;
+        fWalletCoinsIndexed = false;
+        pindexBalances = NULL;
+        fBalancesValid = false;
 
         // Stake Settings
         nHashDrift = 45;
@@ -301,7 +473,8 @@ public:
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed = true, const CCoinControl* coinControl = NULL, bool fIncludeZeroValue = false, AvailableCoinsType nCoinType = ALL_COINS, bool fUseIX = false) const;
     std::map<CBitcoinAddress, std::vector<COutput> > AvailableCoinsByAddress(bool fConfirmed = true, CAmount maxCoinValue = 0);
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const CCoinSelectionPool& pool, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     /// Get 1000DASH output and keys which can be used for the Masternode
     bool GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash = "", std::string strOutputIndex = "");
@@ -385,6 +558,7 @@ public:
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256& hash);
+    CWalletScanFilter GetScanFilter() const;
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -1212,6 +1386,26 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * Spendable outputs offered to CWallet::SelectCoinsMinConf, shuffled and then ordered by
+ * value, largest first, once for all the confirmation tiers SelectCoins tries.
+ */
+class CCoinSelectionPool
+{
+public:
+    struct CCandidate {
+        CAmount nValue;
+        std::pair<const CWalletTx*, unsigned int> coin;
+        int nDepth;
+        bool fFromMe;
+        bool fDenominated;
+    };
+
+    std::vector<CCandidate> vCandidates;
+
+    CCoinSelectionPool(const CWallet& wallet, const std::vector<COutput>& vCoins);
+};
+
 
 /** Private key that includes an expiration date in case it never gets used. */
 class CWalletKey
@@ -27,6 +27,23 @@ unsigned int HaveKeys(const vector<valtype>& pubkeys, const CKeyStore& keystore)
     return nResult;
 }
 
+/**
+ * Whether scriptPubKey is a P2PKH, P2SH or P2PK script in the exact form the keystore
+ * remembers for its keys and redeem scripts. Solver() also accepts these templates with
+ * other push opcodes, which keystore.HaveKnownScript() would not find.
+ */
+static bool IsKnownScriptTemplate(const CScript& scriptPubKey)
+{
+    if (scriptPubKey.IsPayToScriptHash())
+        return true;
+    if (scriptPubKey.size() == 25)
+        return scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 && scriptPubKey[2] == 20 &&
+               scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG;
+    if (scriptPubKey.size() == 35 || scriptPubKey.size() == 67)
+        return scriptPubKey[0] == scriptPubKey.size() - 2 && scriptPubKey.back() == OP_CHECKSIG;
+    return false;
+}
+
 isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest)
 {
     CScript script = GetScriptForDestination(dest);
@@ -35,6 +52,10 @@ isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest)
 
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey)
 {
+    // most outputs are one of these and pay someone else: one lookup instead of Solver()
+    if (IsKnownScriptTemplate(scriptPubKey) && !keystore.HaveKnownScript(scriptPubKey))
+        return ISMINE_NO;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions)) {